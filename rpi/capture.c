@@ -0,0 +1,226 @@
+// reads and writes the binary capture log, and turns it into the old ibus.txt format
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mainloop.h"
+#include "annotate.h"
+#include "capture.h"
+
+
+static void put_u64(unsigned char *out, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+	{
+		out[i] = v >> (i * 8);
+	}
+}
+
+static uint64_t get_u64(const unsigned char *in)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+	{
+		v = (v << 8) | in[i];
+	}
+
+	return v;
+}
+
+/* out must hold CAPTURE_MAX_RECORD bytes, returns the number used */
+
+int capture_encode(unsigned char *out, const capture_record *rec)
+{
+	unsigned char *p = out + CAPTURE_HEADER_LEN;
+	int aux = 0;
+
+	switch (rec->kind)
+	{
+		case CAPTURE_MSG:
+			memcpy(p, rec->text, rec->text_len);
+			p += rec->text_len;
+			break;
+
+		case CAPTURE_MSG_HEX:
+			aux = rec->text_len;
+			memcpy(p, rec->text, rec->text_len);
+			p += rec->text_len;
+			/* fall through */
+
+		default:
+			memcpy(p, rec->data, rec->data_len);
+			p += rec->data_len;
+			break;
+	}
+
+	out[0] = (p - out) - CAPTURE_HEADER_LEN;
+	out[1] = ((p - out) - CAPTURE_HEADER_LEN) >> 8;
+	out[2] = rec->kind;
+	out[3] = aux;
+	put_u64(out + 4, rec->usec);
+
+	return p - out;
+}
+
+/* returns the number of bytes used, 0 if more are needed, -1 if it's garbage */
+
+int capture_decode(const unsigned char *in, int avail, capture_record *rec)
+{
+	int length;
+	int aux;
+
+	if (avail < CAPTURE_HEADER_LEN)
+	{
+		return 0;
+	}
+
+	length = in[0] | (in[1] << 8);
+	if (length > CAPTURE_MAX_RECORD - CAPTURE_HEADER_LEN)
+	{
+		return -1;
+	}
+
+	if (avail < CAPTURE_HEADER_LEN + length)
+	{
+		return 0;
+	}
+
+	rec->kind = in[2];
+	aux = in[3];
+	rec->usec = get_u64(in + 4);
+	in += CAPTURE_HEADER_LEN;
+
+	rec->text_len = 0;
+	rec->data_len = 0;
+
+	switch (rec->kind)
+	{
+		case CAPTURE_MSG:
+			if (length > sizeof(rec->text))
+				return -1;
+			memcpy(rec->text, in, length);
+			rec->text_len = length;
+			break;
+
+		case CAPTURE_MSG_HEX:
+			if (aux > length || aux > sizeof(rec->text) || length - aux > sizeof(rec->data))
+				return -1;
+			memcpy(rec->text, in, aux);
+			rec->text_len = aux;
+			memcpy(rec->data, in + aux, length - aux);
+			rec->data_len = length - aux;
+			break;
+
+		case CAPTURE_RX:
+		case CAPTURE_RECOVER:
+		case CAPTURE_CORRUPT:
+		case CAPTURE_TX:
+		case CAPTURE_SESSION:
+			if (length > sizeof(rec->data))
+				return -1;
+			memcpy(rec->data, in, length);
+			rec->data_len = length;
+			break;
+
+		default:
+			return -1;
+	}
+
+	return CAPTURE_HEADER_LEN + length;
+}
+
+uint64_t capture_session_start(const capture_record *rec)
+{
+	return (rec->data_len >= 8) ? get_u64(rec->data) : 0;
+}
+
+uint64_t capture_session_time(const capture_record *rec)
+{
+	return (rec->data_len >= 16) ? get_u64(rec->data + 8) : 0;
+}
+
+static int format_hex(char *out, const unsigned char *data, int length)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < length; i++)
+	{
+		*out++ = hex[data[i] >> 4];
+		*out++ = hex[data[i] & 15];
+	}
+
+	return length * 2;
+}
+
+/* out must hold CAPTURE_MAX_TEXT bytes, start is in seconds. Returns the length, not terminated. */
+
+int capture_format_text(char *out, const capture_record *rec, uint64_t start, int level)
+{
+	int len;
+
+	if (rec->kind == CAPTURE_SESSION)
+	{
+		return 0;
+	}
+
+	len = sprintf(out, "%6.6lu.%03lu ", (unsigned long)((rec->usec / 1000000) - start), (unsigned long)((rec->usec / 1000) % 1000));
+
+	switch (rec->kind)
+	{
+		case CAPTURE_MSG:
+			out[len++] = '#';
+			memcpy(out + len, rec->text, rec->text_len);
+			len += rec->text_len;
+			break;
+
+		case CAPTURE_MSG_HEX:
+			out[len++] = '#';
+			memcpy(out + len, rec->text, rec->text_len);
+			len += rec->text_len;
+			len += format_hex(out + len, rec->data, rec->data_len);
+			out[len++] = '\n';
+			break;
+
+		case CAPTURE_TX:
+			len += sprintf(out + len, "#service_queue len=%d data=", rec->data_len);
+			len += format_hex(out + len, rec->data, rec->data_len);
+			out[len++] = '\n';
+			break;
+
+		default:
+			len += format_hex(out + len, rec->data, rec->data_len);
+
+			if (level && rec->data_len >= 3)
+			{
+				len += sprintf(out + len, " %s", annotate_device_to_device(rec->data[0], rec->data[2]));
+
+				if (level >= 2)
+				{
+					out[len++] = ' ';
+					out[len] = 0;
+					annotate_ibus_message(out + len, 512, rec->data, rec->data_len, (level>=3) ? TRUE : FALSE);
+					len += strlen(out + len);
+				}
+			}
+
+			if (rec->kind == CAPTURE_RECOVER)
+			{
+				len += sprintf(out + len, " recover");
+			}
+			else if (rec->kind == CAPTURE_CORRUPT)
+			{
+				len += sprintf(out + len, " corrupt");
+			}
+			out[len++] = '\n';
+			break;
+	}
+
+	return len;
+}
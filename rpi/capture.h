@@ -0,0 +1,46 @@
+/*
+ * Binary IBUS capture format
+ *
+ * The file starts with CAPTURE_MAGIC, followed by records:
+ *
+ *   u16 payload length, u8 kind, u8 aux, u64 CLOCK_MONOTONIC microseconds, payload
+ *
+ * All numbers are little endian. Every pibus run starts with a CAPTURE_SESSION
+ * record, the text timestamps are relative to it.
+ */
+
+#define CAPTURE_MAGIC "PIBUSCAP\x01\x00\x00\x00"
+#define CAPTURE_MAGIC_LEN 12
+#define CAPTURE_HEADER_LEN 12
+
+typedef enum
+{
+	CAPTURE_MSG = 0,	/* text */
+	CAPTURE_MSG_HEX = 1,	/* text followed by data, aux is the text length */
+	CAPTURE_RX = 2,		/* received ibus message */
+	CAPTURE_RECOVER = 3,	/* recovered from a corrupt one */
+	CAPTURE_CORRUPT = 4,	/* bad checksum */
+	CAPTURE_TX = 5,		/* ibus message we're transmitting */
+	CAPTURE_SESSION = 6	/* u64 start in CLOCK_MONOTONIC seconds, u64 time() */
+}
+capture_kind;
+
+typedef struct
+{
+	uint64_t usec;
+	capture_kind kind;
+	int text_len;
+	int data_len;
+	char text[256];
+	unsigned char data[256];
+}
+capture_record;
+
+#define CAPTURE_MAX_RECORD (CAPTURE_HEADER_LEN + 256 + 256)
+#define CAPTURE_MAX_TEXT 2048
+
+int capture_encode(unsigned char *out, const capture_record *rec);
+int capture_decode(const unsigned char *in, int avail, capture_record *rec);
+uint64_t capture_session_start(const capture_record *rec);
+uint64_t capture_session_time(const capture_record *rec);
+int capture_format_text(char *out, const capture_record *rec, uint64_t start, int level);
@@ -46,7 +46,7 @@ static unsigned int gpio_base_address()
 	int fd;
 	unsigned int base = V1_GPIO_BASE;
 
-	fd = open("/sys/firmware/devicetree/base/model", O_RDONLY);
+	fd = open("/sys/firmware/devicetree/base/model", O_RDONLY | O_CLOEXEC);
 	if (fd != -1)
 	{
 		if (read(fd, buf, sizeof (buf)) > 10)
@@ -76,7 +76,7 @@ int gpio_init()
 	void *gpio_map;
 	int mem_fd;
 
-	if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC) ) < 0)
+	if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC) ) < 0)
 	{
 		printf("can't open /dev/mem \n");
 		exit(-1);
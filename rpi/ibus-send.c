@@ -4,33 +4,151 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 
 #include "gpio.h"
 #include "mainloop.h"
 #include "ibus.h"
 #include "ibus-send.h"
-#include "slist.h"
 #include "server.h"
+#include "capture.h"
 #include "log.h"
 
 
-static SList *pkt_list = NULL;
+/* the bus has to be quiet this long before we transmit */
+#define TX_IDLE_US	10000
+/* send it again if it hasn't echoed back by then */
+#define TX_RETRY_US	500000
+/* look again this soon if the line or the UART is busy */
+#define TX_BUSY_US	2000
+/* 9600 baud, start + 8 data + parity + stop bits */
+#define TX_BYTE_US	(11 * 1000000 / 9600)
+/* bytes arriving this soon after our own frame left are its echo, not somebody else talking */
+#define TX_ECHO_US	10000
+/* give up on the UART ever finishing a frame after this */
+#define TX_DRAIN_US	500000
+
+/* echo and tag index sizes, powers of 2 */
+#define ECHO_BUCKETS	64
+#define TAG_BUCKETS	32
+/* client tags differ in the connection id above the low byte */
+#define TAG_HASH(tag)	(((tag) ^ ((tag) >> 8)) & (TAG_BUCKETS - 1))
+
 static bool port_good = FALSE;
 
+static struct
+{
+	int weight;	/* turns against the other weighted classes, 0 = strict priority */
+	int limit;	/* most packets queued at once, client gets what's left of the pool */
+}
+tx_class[PRIO_COUNT] =
+{
+	[PRIO_REALTIME] = { 0, 16 },
+	[PRIO_CONTROL] = { 3, 32 },
+	[PRIO_CLIENT] = { 1, 256 },
+};
 
+static struct
+{
+	int ifd;
+	int gpio_number;
+	int gap;		/* microseconds between our own frames in a burst */
+	int burst;		/* frames allowed out before the first of them echoes */
+	uint64_t last_rx;	/* last time somebody else's bytes arrived, microseconds */
+	uint64_t wire_end;	/* when the last byte we wrote has left the UART */
+	uint64_t due;		/* what the timer is set for */
+	int tag;
+	bool busy;		/* last attempt found the line busy */
+	int drain_tag;		/* polling for the frame on the wire to finish */
+	struct _packet *sending;	/* that frame, NULL if it's been freed since */
+	unsigned char out[256];	/* what a short write() left over */
+	int out_len;
+	int out_off;
+	int depth[PRIO_COUNT];	/* packets queued per class */
+	int credit[PRIO_COUNT];	/* turns left in this round */
+	struct _packet_batch *batch;	/* started going out, the rest of it goes next */
+}
+tx =
+{
+	.ifd = -1,
+	.gap = 3000,
+	.burst = 8,
+	.tag = -1,
+	.drain_tag = -1,
+};
 
-typedef struct
+
+
+typedef struct _packet
 {
-	unsigned char msg[232];
+	unsigned char msg[256];
 	int length;
-	int countdown;
+	uint64_t retry_at;	/* don't send before this, 0 = as soon as the bus is idle */
 	bool sync;
 	int tag;
+	int prio;
 	int transmit_count;
+	uint64_t cookie;	/* for server_notify_done(), 0 = nobody's waiting */
+	struct _packet_batch *batch;
+	struct _packet *prev, *next;		/* its class's pending or flight list */
+	struct _packet *echo_prev, *echo_next;	/* echo_index bucket */
+	struct _packet *tag_prev, *tag_next;	/* tag_index bucket, if it has a tag */
 }
 packet;
 
+typedef struct
+{
+	packet *head;
+	packet *tail;
+}
+pkt_list;
+
+/*
+ * Each class's packets are either pending, in the order they were queued, or
+ * sent and waiting for their echo, in the order they're due to be retried.
+ * So the next one to go is always at one of the two heads.
+ */
+static struct
+{
+	pkt_list pending;
+	pkt_list flight;
+	int in_flight;		/* on the flight list */
+}
+pkt_queue[PRIO_COUNT];
+
+/* every queued packet by the bytes its echo will have, and the tagged ones by tag */
+static packet *echo_index[ECHO_BUCKETS];
+static packet *tag_index[TAG_BUCKETS];
+
+/* frames queued together by ibus_send_batch() */
+typedef struct _packet_batch
+{
+	int remaining;		/* still in the queue */
+	int unsent;		/* still in the queue and never sent */
+	int status;		/* TX_ECHOED unless one of them wasn't */
+	uint64_t cookie;
+	struct _packet_batch *next;	/* free list */
+}
+packet_batch;
+
+/*
+ * Every packet comes from here, allocated once when the port is first opened.
+ * Free packets are chained through ->next. There can't be more batches than
+ * packets so that pool never runs out first.
+ */
+static struct
+{
+	int size;
+	int used;
+	packet *free;
+	packet_batch *free_batch;
+}
+pool =
+{
+	.size = 320,
+};
+
 
 int get_cts(int fd)
 {
@@ -41,155 +159,722 @@ int get_cts(int fd)
 	return ((currstat & TIOCM_CTS) ? 1 : 0);
 }
 
-/* called every 50ms */
+/* after = NULL puts it at the head */
 
-bool ibus_service_queue(int ifd, bool can_send, int gpio_number, bool *giveup)
+static void ibus_list_insert(pkt_list *list, packet *after, packet *pkt)
+{
+	pkt->prev = after;
+	pkt->next = after ? after->next : list->head;
+	if (pkt->next)
+		pkt->next->prev = pkt;
+	else
+		list->tail = pkt;
+	if (after)
+		after->next = pkt;
+	else
+		list->head = pkt;
+}
+
+static void ibus_list_unlink(pkt_list *list, packet *pkt)
+{
+	if (pkt->prev)
+		pkt->prev->next = pkt->next;
+	else
+		list->head = pkt->next;
+	if (pkt->next)
+		pkt->next->prev = pkt->prev;
+	else
+		list->tail = pkt->prev;
+}
+
+/* off whichever list it's on, a packet that was ever sent is on the flight list */
+
+static void ibus_queue_take(packet *pkt)
+{
+	if (pkt->transmit_count)
+	{
+		ibus_list_unlink(&pkt_queue[pkt->prio].flight, pkt);
+		pkt_queue[pkt->prio].in_flight--;
+	}
+	else
+	{
+		ibus_list_unlink(&pkt_queue[pkt->prio].pending, pkt);
+	}
+}
+
+/* onto the flight list by retry_at, nearly always at the tail */
+
+static void ibus_flight_insert(packet *pkt)
+{
+	pkt_list *list = &pkt_queue[pkt->prio].flight;
+	packet *after;
+
+	for (after = list->tail; after && after->retry_at > pkt->retry_at; after = after->prev)
+		;
+	ibus_list_insert(list, after, pkt);
+	pkt_queue[pkt->prio].in_flight++;
+}
+
+/* retry_at of a packet on the flight list changed */
+
+static void ibus_flight_retry(packet *pkt, uint64_t retry_at)
+{
+	ibus_queue_take(pkt);
+	pkt->retry_at = retry_at;
+	ibus_flight_insert(pkt);
+}
+
+/* one more of the batch went out for the first time */
+
+static void ibus_batch_sent(struct _packet_batch *batch)
+{
+	batch->unsent--;
+	tx.batch = batch->unsent ? batch : NULL;
+}
+
+static int ibus_tx_timeout(void *unused);
+static void ibus_tx_schedule(void);
+static void ibus_tx_start_drain(struct _packet *pkt, int written, uint64_t now);
+
+/*
+ * Which class goes next: realtime whenever it has something, the others take
+ * turns by weight, a batch counts as one turn. Once everybody waiting has used
+ * up their turns, whoever is first in line goes and ibus_tx_charge() starts a
+ * new round.
+ */
+
+static packet *ibus_tx_pick(packet **cand)
 {
-	SList *list;
 	packet *pkt;
-	int i;
-	int packets_sent;
+	int c;
+
+	/* a batch goes out in one piece, only realtime replies may cut in */
+	if (tx.batch)
+	{
+		if (cand[PRIO_REALTIME])
+		{
+			return cand[PRIO_REALTIME];
+		}
+		pkt = pkt_queue[PRIO_CLIENT].pending.head;
+		if (pkt && pkt->batch == tx.batch)
+		{
+			return pkt;
+		}
+		tx.batch = NULL;	/* shouldn't happen, don't get stuck on it */
+	}
 
-	*giveup = FALSE;
+	for (c = 0; c < PRIO_COUNT; c++)
+	{
+		if (cand[c] && (tx_class[c].weight == 0 || tx.credit[c] > 0))
+		{
+			return cand[c];
+		}
+	}
 
-	list = pkt_list;
-	while (list)
+	for (c = 0; c < PRIO_COUNT; c++)
 	{
-		pkt = list->data;
-		if (pkt->countdown)
+		if (cand[c])
 		{
-			pkt->countdown--;
+			return cand[c];
 		}
-		list = list->next;
 	}
 
-	if (!can_send)
+	return NULL;
+}
+
+static void ibus_tx_charge(int prio)
+{
+	int c;
+
+	if (tx_class[prio].weight == 0)
 	{
-		return FALSE;
+		return;
+	}
+
+	if (tx.credit[prio] <= 0)
+	{
+		for (c = 0; c < PRIO_COUNT; c++)
+		{
+			tx.credit[c] = tx_class[c].weight;
+		}
+	}
+	tx.credit[prio]--;
+}
+
+/*
+ * A class's next packet: one that didn't echo back in time goes again first,
+ * then the oldest one not sent yet, unless capped by the burst limit. A sync
+ * packet waits until everything in front of it in its class has echoed back.
+ */
+
+static packet *ibus_tx_candidate(int c, uint64_t now, bool capped)
+{
+	packet *pkt;
+
+	pkt = pkt_queue[c].flight.head;
+	if (pkt && pkt->retry_at <= now)
+	{
+		return pkt;
+	}
+
+	pkt = pkt_queue[c].pending.head;
+	if (pkt == NULL || capped || (pkt->sync && pkt_queue[c].flight.head))
+	{
+		return NULL;
+	}
+	return pkt;
+}
+
+/*
+ * The next packet that may go out and the earliest time it may go out: once
+ * the bus has been idle for TX_IDLE_US and one gap after our previous frame.
+ * No more than tx.burst control and client frames wait for their echo at
+ * once, realtime replies never wait for those. Nothing goes while the previous
+ * frame is still leaving the UART. Only looks at the heads of the lists,
+ * however much is queued.
+ */
+
+static packet *ibus_tx_next(uint64_t now, uint64_t *due)
+{
+	packet *cand[PRIO_COUNT];
+	packet *pkt;
+	uint64_t retry = 0;
+	int in_flight = 0;
+	int c;
+
+	/* one frame at a time in the UART, the drain poll carries on when it's out */
+	if (tx.drain_tag != -1)
+	{
+		*due = 0;
+		return NULL;
 	}
 
-	if (pkt_list)
+	for (c = 0; c < PRIO_COUNT; c++)
 	{
-		if (gpio_number == 0 && !get_cts(ifd))
+		if (c != PRIO_REALTIME)
 		{
-			log_msg("service_queue(): cts busy - waiting\n");
-			return TRUE;
+			in_flight += pkt_queue[c].in_flight;
 		}
 
-		/* Only send if GPIO 15 (UART RX) is high (idle state) */
-		if (!gpio_read(15))
+		/* the earliest retry, in case nothing can go before then */
+		pkt = pkt_queue[c].flight.head;
+		if (pkt && (retry == 0 || pkt->retry_at < retry))
 		{
-			log_msg("service_queue(): ibus/gpio busy - waiting\n");
-			return TRUE;
+			retry = pkt->retry_at;
 		}
+	}
 
-		/* If the RX FIFO contains bytes, don't send now! */
-		if (!uart_rx_fifo_empty())
+	for (c = 0; c < PRIO_COUNT; c++)
+	{
+		cand[c] = ibus_tx_candidate(c, now, c != PRIO_REALTIME && in_flight >= tx.burst);
+	}
+
+	pkt = ibus_tx_pick(cand);
+	if (pkt == NULL)
+	{
+		/* nothing to send until an echo arrives or a retry comes up */
+		*due = retry;
+		return NULL;
+	}
+
+	*due = tx.last_rx + TX_IDLE_US;
+	if (tx.wire_end + tx.gap > *due)
+	{
+		*due = tx.wire_end + tx.gap;
+	}
+	return pkt;
+}
+
+static void ibus_tx_arm(uint64_t due, uint64_t now)
+{
+	if (tx.tag != -1)
+	{
+		if (tx.due == due)
 		{
-			log_msg("service_queue(): rx fifo not empty - waiting\n");
-			return TRUE;
+			return;
 		}
+		mainloop_timeout_remove(tx.tag);
+		tx.tag = -1;
 	}
 
-	i = 0;
-	packets_sent = 0;
-	list = pkt_list;
-	while (list)
+	if (due == 0)
 	{
-		pkt = list->data;
+		return;
+	}
+
+	tx.due = due;
+	tx.tag = mainloop_timeout_add_usec(due > now ? due - now : 0, TIMER_SKIP, ibus_tx_timeout, NULL);
+}
 
-		if (pkt->sync && i != 0)
+static int ibus_tx_timeout(void *unused)
+{
+	packet *pkt;
+	uint64_t now;
+	uint64_t due;
+	int r;
+
+	tx.tag = -1;
+	now = mainloop_get_microsec();
+
+	/* the port couldn't be reopened, the fd number may belong to something else by now */
+	if (tx.ifd == -1)
+	{
+		return 0;
+	}
+
+	pkt = ibus_tx_next(now, &due);
+	if (pkt == NULL || due > now)
+	{
+		/* the bus got busy again since the timer was set */
+		ibus_tx_arm(due, now);
+		return 0;
+	}
+
+	if ((tx.gpio_number == 0 && !get_cts(tx.ifd)) ||
+	    !gpio_read(15) ||		/* GPIO 15 (UART RX) is low, somebody's transmitting */
+	    !uart_rx_fifo_empty())	/* don't talk over bytes we haven't read yet */
+	{
+		if (!tx.busy)
 		{
-			/* must send all previous items first (including echo-back) */
-			break;
+			log_msg("service_queue(): line busy - waiting\n");
+			tx.busy = TRUE;
 		}
+		ibus_tx_arm(now + TX_BUSY_US, now);
+		return 0;
+	}
+	tx.busy = FALSE;
 
-		if (pkt->countdown == 0)
+	log_ibus(pkt->msg, pkt->length, CAPTURE_TX);
+	r = write(tx.ifd, pkt->msg, pkt->length);
+	if (r == -1)
+	{
+		if (errno != EAGAIN)
+		{
+			log_msg("ibus write failed: %s\n", strerror(errno));
+			r = pkt->length;	/* it'll be retried when it doesn't echo */
+		}
+		else
 		{
-			log_msg_with_hex(pkt->msg, pkt->length, "service_queue len=%d data=", pkt->length);
-			write(ifd, pkt->msg, pkt->length);
+			r = 0;
+		}
+	}
 
-			/* tell the server we're transmitting a message now */
-			server_notify_tx(pkt->msg, pkt->length);
+	/* tell the server we're transmitting a message now */
+	server_notify_tx(pkt->msg, pkt->length);
 
-			pkt->transmit_count++;
-			if (pkt->transmit_count > 3 && !port_good)
-			{
-				pkt->transmit_count = 1;
-				*giveup = TRUE;
-				return FALSE;
-			}
+	if (pkt->batch == NULL || pkt->batch != tx.batch)
+	{
+		ibus_tx_charge(pkt->prio);
+	}
+	if (pkt->batch && pkt->transmit_count == 0)
+	{
+		ibus_batch_sent(pkt->batch);
+	}
+
+	ibus_queue_take(pkt);
+	pkt->transmit_count++;
+	ibus_tx_start_drain(pkt, r, now);
+	ibus_flight_insert(pkt);
+
+	if (pkt->transmit_count > 3 && !port_good)
+	{
+		pkt->transmit_count = 1;
+		log_msg("serial port is broken - reopening\n");
+		ibus_reopen_port();
+		ibus_flight_retry(pkt, now + TX_IDLE_US);
+		ibus_tx_schedule();
+	}
+
+	return 0;
+}
+
+/*
+ * Has the frame completely left the UART: the rest of a short write went,
+ * the tty buffer is empty and so is the transmit shift register. Drivers
+ * without TIOCSERGETLSR only tell us about the buffer.
+ */
+
+static bool ibus_tx_drained(int *queued)
+{
+	unsigned int lsr = TIOCSER_TEMT;
+	int r;
+
+	*queued = 0;
 
-			/* send again if it doesn't echo back within 0.5 seconds (10 * 50ms) */
-			pkt->countdown = 10;
-			packets_sent++;
+	if (tx.ifd == -1)
+	{
+		return TRUE;
+	}
+
+	if (tx.out_off < tx.out_len)
+	{
+		r = write(tx.ifd, tx.out + tx.out_off, tx.out_len - tx.out_off);
+		if (r > 0)
+		{
+			tx.out_off += r;
 		}
+		*queued = tx.out_len - tx.out_off;
+		if (*queued)
+		{
+			return FALSE;
+		}
+	}
 
-		i++;
-		/*list = list->next;*/
-		list = NULL;	/* never loop, maintain >10ms gap */
+	if (ioctl(tx.ifd, TIOCOUTQ, queued) == -1)
+	{
+		*queued = 0;
 	}
+	if (*queued > 0)
+	{
+		return FALSE;
+	}
+
+	ioctl(tx.ifd, TIOCSERGETLSR, &lsr);
+	return (lsr & TIOCSER_TEMT) != 0;
+}
+
+static int ibus_tx_drain_timeout(void *unused)
+{
+	uint64_t now;
+	int queued;
 
-	if (packets_sent)
+	tx.drain_tag = -1;
+	now = mainloop_get_microsec();
+
+	if (!ibus_tx_drained(&queued))
 	{
-		fsync(ifd);
+		if (now < tx.wire_end + TX_DRAIN_US)
+		{
+			/* look again about when it should be done */
+			tx.drain_tag = mainloop_timeout_add_usec((queued ? queued : 1) * TX_BYTE_US, TIMER_SKIP, ibus_tx_drain_timeout, NULL);
+			return 0;
+		}
+
+		log_msg("ibus frame didn't leave the UART, flushing it\n");
+		tcflush(tx.ifd, TCOFLUSH);
+		tx.out_len = tx.out_off = 0;
 	}
 
-	return FALSE;
+	/* from here on the gap and the echo timeout count */
+	tx.wire_end = now;
+	if (tx.sending)
+	{
+		ibus_flight_retry(tx.sending, now + TX_RETRY_US);
+		tx.sending = NULL;
+	}
+
+	ibus_tx_schedule();
+	return 0;
+}
+
+/* written bytes of pkt went to the tty, poll for when they've been sent */
+
+static void ibus_tx_start_drain(struct _packet *pkt, int written, uint64_t now)
+{
+	tx.out_len = pkt->length - written;
+	tx.out_off = 0;
+	memcpy(tx.out, pkt->msg + written, tx.out_len);
+
+	tx.sending = pkt;
+	tx.wire_end = now + pkt->length * TX_BYTE_US;
+	pkt->retry_at = tx.wire_end + TX_RETRY_US;
+
+	if (tx.drain_tag != -1)
+	{
+		mainloop_timeout_remove(tx.drain_tag);
+	}
+	tx.drain_tag = mainloop_timeout_add_usec(pkt->length * TX_BYTE_US, TIMER_SKIP, ibus_tx_drain_timeout, NULL);
+
+	/* nothing else goes out until it's done */
+	ibus_tx_arm(0, now);
+}
+
+/* (re)arm the timer after the queue or the bus changed */
+
+static void ibus_tx_schedule(void)
+{
+	uint64_t now;
+	uint64_t due;
+
+	now = mainloop_get_microsec();
+	ibus_tx_next(now, &due);
+	ibus_tx_arm(due, now);
+}
+
+/*
+ * gap in milliseconds between frames of a burst, burst = frames out at once
+ * without an echo, queue = packets in the pool
+ */
+
+void ibus_tx_config(int gap, int burst, int queue)
+{
+	int reserved;
+
+	tx.gap = gap * 1000;
+	tx.burst = burst > 0 ? burst : 1;
+
+	/* realtime and control always find room, whatever the clients are up to */
+	reserved = tx_class[PRIO_REALTIME].limit + tx_class[PRIO_CONTROL].limit;
+	pool.size = queue > reserved + 16 ? queue : reserved + 16;
+	tx_class[PRIO_CLIENT].limit = pool.size - reserved;
+}
+
+static void ibus_pool_init(void)
+{
+	packet *packets;
+	packet_batch *batches;
+	int i;
+
+	packets = calloc(pool.size, sizeof(packet));
+	batches = calloc(pool.size, sizeof(packet_batch));
+	if (packets == NULL || batches == NULL)
+	{
+		/* everything gets refused as queue full. This runs before log_open() */
+		fprintf(stderr, "No memory for %d transmit packets\n", pool.size);
+		free(packets);
+		free(batches);
+		pool.size = 0;
+		for (i = 0; i < PRIO_COUNT; i++)
+		{
+			tx_class[i].limit = 0;
+		}
+		return;
+	}
+
+	for (i = pool.size - 1; i >= 0; i--)
+	{
+		packets[i].next = pool.free;
+		pool.free = &packets[i];
+		batches[i].next = pool.free_batch;
+		pool.free_batch = &batches[i];
+	}
+}
+
+static packet *ibus_pool_get(void)
+{
+	packet *pkt = pool.free;
+
+	if (pkt)
+	{
+		pool.free = pkt->next;
+		pool.used++;
+	}
+	return pkt;
+}
+
+static void ibus_pool_put(packet *pkt)
+{
+	pkt->next = pool.free;
+	pool.free = pkt;
+	pool.used--;
+}
+
+/* called whenever the serial port is (re)opened */
+
+void ibus_tx_init(int ifd, int gpio_number)
+{
+	tx.ifd = ifd;
+	tx.gpio_number = gpio_number;
+
+	if (pool.free == NULL && pool.used == 0 && pool.size > 0)
+	{
+		ibus_pool_init();
+	}
+
+	/* whatever was on its way went with the old descriptor */
+	if (tx.drain_tag != -1)
+	{
+		mainloop_timeout_remove(tx.drain_tag);
+		tx.drain_tag = -1;
+		tx.wire_end = mainloop_get_microsec();
+	}
+	tx.sending = NULL;
+	tx.out_len = tx.out_off = 0;
+}
+
+/* ibus.c read some bytes, the bus isn't idle unless they're our own echo */
+
+void ibus_tx_bus_active(uint64_t now)
+{
+	if (tx.drain_tag == -1 && now > tx.wire_end + TX_ECHO_US)
+	{
+		tx.last_rx = now;
+	}
+}
+
+/* length, checksum and the address and command bytes, the rest is up to memcmp() */
+
+static unsigned int ibus_echo_hash(const unsigned char *msg, int length)
+{
+	if (length < 4)
+	{
+		return 0;
+	}
+	return (length * 31 + msg[0] * 7 + msg[2] * 5 + msg[3] * 3 + msg[length - 1]) & (ECHO_BUCKETS - 1);
+}
+
+/* onto the end of its class's pending list and into the indexes */
+
+static void ibus_link_packet(packet *pkt)
+{
+	packet **bucket;
+
+	ibus_list_insert(&pkt_queue[pkt->prio].pending, pkt_queue[pkt->prio].pending.tail, pkt);
+
+	/* buckets go newest first */
+	bucket = &echo_index[ibus_echo_hash(pkt->msg, pkt->length)];
+	pkt->echo_prev = NULL;
+	pkt->echo_next = *bucket;
+	if (*bucket)
+		(*bucket)->echo_prev = pkt;
+	*bucket = pkt;
+
+	pkt->tag_prev = pkt->tag_next = NULL;
+	if (pkt->tag)
+	{
+		bucket = &tag_index[TAG_HASH(pkt->tag)];
+		pkt->tag_next = *bucket;
+		if (*bucket)
+			(*bucket)->tag_prev = pkt;
+		*bucket = pkt;
+	}
+
+	tx.depth[pkt->prio]++;
+}
+
+static void ibus_unlink_packet(packet *pkt)
+{
+	ibus_queue_take(pkt);
+
+	if (pkt->echo_prev)
+		pkt->echo_prev->echo_next = pkt->echo_next;
+	else
+		echo_index[ibus_echo_hash(pkt->msg, pkt->length)] = pkt->echo_next;
+	if (pkt->echo_next)
+		pkt->echo_next->echo_prev = pkt->echo_prev;
+
+	if (pkt->tag)
+	{
+		if (pkt->tag_prev)
+			pkt->tag_prev->tag_next = pkt->tag_next;
+		else
+			tag_index[TAG_HASH(pkt->tag)] = pkt->tag_next;
+		if (pkt->tag_next)
+			pkt->tag_next->tag_prev = pkt->tag_prev;
+	}
+
+	tx.depth[pkt->prio]--;
+}
+
+static void ibus_free_packet(packet *pkt, int status)
+{
+	packet_batch *batch = pkt->batch;
+
+	if (pkt == tx.sending)
+	{
+		tx.sending = NULL;
+	}
+
+	if (batch)
+	{
+		if (pkt->transmit_count == 0 && --batch->unsent == 0 && batch == tx.batch)
+		{
+			tx.batch = NULL;
+		}
+
+		if (status != TX_ECHOED)
+		{
+			batch->status = status;
+		}
+
+		if (--batch->remaining == 0)
+		{
+			if (batch->cookie)
+			{
+				server_notify_done(batch->cookie, batch->status);
+			}
+			if (batch == tx.batch)
+			{
+				tx.batch = NULL;
+			}
+			batch->next = pool.free_batch;
+			pool.free_batch = batch;
+		}
+	}
+	else if (pkt->cookie)
+	{
+		server_notify_done(pkt->cookie, status);
+	}
+
+	ibus_pool_put(pkt);
+}
+
+static void ibus_remove_packet(packet *pkt, int status)
+{
+	ibus_unlink_packet(pkt);
+	ibus_free_packet(pkt, status);
 }
 
 void ibus_discard_queue(void)
 {
-	SList *list = pkt_list;
-	packet *pkt;
+	int c;
 
-	while (list)
+	for (c = 0; c < PRIO_COUNT; c++)
 	{
-		pkt = list->data;
-		pkt_list = slist_remove(pkt_list, pkt);
-		free (pkt);
-		list = pkt_list;
+		while (pkt_queue[c].flight.head)
+		{
+			ibus_remove_packet(pkt_queue[c].flight.head, TX_DISCARDED);
+		}
+		while (pkt_queue[c].pending.head)
+		{
+			ibus_remove_packet(pkt_queue[c].pending.head, TX_DISCARDED);
+		}
 	}
+
+	ibus_tx_schedule();
 }
 
+/* a frame came in, if it's one of ours it made it */
+
 void ibus_remove_from_queue(const unsigned char *msg, int length)
 {
-	SList *list = pkt_list;
 	packet *pkt;
+	packet *match = NULL;
 
-	while (list)
+	/* the oldest one that went out, or the oldest one if none of them has */
+	for (pkt = echo_index[ibus_echo_hash(msg, length)]; pkt; pkt = pkt->echo_next)
 	{
-		pkt = list->data;
-		if (pkt->length == length && memcmp(pkt->msg, msg, length) == 0)
+		if (pkt->length == length && memcmp(pkt->msg, msg, length) == 0 &&
+		    (match == NULL || pkt->transmit_count || !match->transmit_count))
 		{
-			port_good = TRUE;
-			log_msg("remove_queue len=%d success\n", length);
-			pkt_list = slist_remove(pkt_list, pkt);
-			free (pkt);
-			return;
+			match = pkt;
 		}
-		list = list->next;
+	}
+
+	if (match)
+	{
+		port_good = TRUE;
+		log_msg("remove_queue len=%d success\n", length);
+		ibus_remove_packet(match, TX_ECHOED);
+		ibus_tx_schedule();
 	}
 }
 
 void ibus_remove_tag_from_queue(int tag)
 {
-	SList *list;
 	packet *pkt;
+	packet *next;
 
-start:
-	list = pkt_list;
-	while (list)
+	for (pkt = tag_index[TAG_HASH(tag)]; pkt; pkt = next)
 	{
-		pkt = list->data;
+		next = pkt->tag_next;
 		if (pkt->tag == tag)
 		{
-			pkt_list = slist_remove(pkt_list, pkt);
-			free (pkt);
-			goto start;
+			ibus_remove_packet(pkt, TX_DISCARDED);
 		}
-		list = list->next;
 	}
+
+	ibus_tx_schedule();
 }
 
 static unsigned char ibus_calc_sum(const unsigned char *msg, int length)
@@ -206,35 +891,124 @@ static unsigned char ibus_calc_sum(const unsigned char *msg, int length)
 	return sum;
 }
 
-static void ibus_add_to_queue(const unsigned char *msg, int length, int countdown, bool sync, bool prepend, int tag)
+static void ibus_init_packet(packet *pkt, const unsigned char *msg, int length, bool sync, int prio, int tag, uint64_t cookie)
 {
-	packet *pkt;
-
-	pkt = malloc(sizeof(packet));
 	memcpy(pkt->msg, msg, length);
 	pkt->msg[length - 1] = ibus_calc_sum(pkt->msg, length);
 	pkt->length = length;
-	pkt->countdown = countdown;
+	pkt->retry_at = 0;
 	pkt->sync = sync;
 	pkt->tag = tag;
+	pkt->prio = prio;
 	pkt->transmit_count = 0;
+	pkt->cookie = cookie;
+	pkt->batch = NULL;
+}
 
-	if (prepend)
-		pkt_list = slist_prepend(pkt_list, pkt);
-	else
-		pkt_list = slist_append(pkt_list, pkt);
+static int ibus_add_to_queue(const unsigned char *msg, int length, bool sync, int prio, int tag, uint64_t cookie)
+{
+	packet *pkt;
+
+	if (tx.depth[prio] >= tx_class[prio].limit || (pkt = ibus_pool_get()) == NULL)
+	{
+		log_msg("send queue %d full, dropping len=%d\n", prio, length);
+		return SEND_QUEUE_FULL;
+	}
+
+	ibus_init_packet(pkt, msg, length, sync, prio, tag, cookie);
+
+	ibus_link_packet(pkt);
+
+	ibus_tx_schedule();
+
+	return 0;
 }
 
-void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number)
+int ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number)
 {
 	log_msg_with_hex(msg, length, "send len=%d data=", length);
 
-	ibus_add_to_queue(msg, length, 1, FALSE, FALSE, 0);
+	return ibus_add_to_queue(msg, length, FALSE, PRIO_CONTROL, 0, 0);
 }
 
-void ibus_send_with_tag(int ifd, const unsigned char *msg, int length, int gpio_number, bool sync, bool prepend, int tag)
+/* a client's frame, server_notify_done(cookie) is called when it echoes back or is discarded */
+
+int ibus_send_with_cookie(int ifd, const unsigned char *msg, int length, int gpio_number, uint64_t cookie)
+{
+	log_msg_with_hex(msg, length, "send len=%d data=", length);
+
+	return ibus_add_to_queue(msg, length, FALSE, PRIO_CLIENT, 0, cookie);
+}
+
+int ibus_send_with_tag(int ifd, const unsigned char *msg, int length, int gpio_number, bool sync, int prio, int tag)
 {
 	log_msg_with_hex(msg, length, "send len=%d tag=%d data=", length, tag);
 
-	ibus_add_to_queue(msg, length, 1, sync, prepend, tag);
+	return ibus_add_to_queue(msg, length, sync, prio, tag, 0);
+}
+
+/*
+ * Frames back to back, each one's length byte says where the next one starts.
+ * They're queued together as client traffic, or not at all if any of them is bad
+ * or there isn't room for all of them. A tag replaces
+ * whatever is still queued with the same tag. server_notify_done(cookie) is
+ * called once, when the last of them has echoed back or been thrown away.
+ */
+
+int ibus_send_batch(int ifd, const unsigned char *frames, int length, int gpio_number, bool sync, int tag, uint64_t cookie)
+{
+	packet_batch *batch;
+	packet *pkt;
+	int count;
+	int pos;
+	int i;
+
+	for (count = 0, pos = 0; pos < length; count++)
+	{
+		if (length - pos < 5 || frames[pos + 1] < 3 || frames[pos + 1] > 253 || frames[pos + 1] + 2 > length - pos)
+		{
+			return 2;
+		}
+		pos += frames[pos + 1] + 2;
+	}
+
+	if (count == 0)
+	{
+		return 2;
+	}
+
+	/* a refused batch leaves whatever it would have replaced alone */
+	if (tx.depth[PRIO_CLIENT] + count > tx_class[PRIO_CLIENT].limit || pool.size - pool.used < count ||
+	    pool.free_batch == NULL)
+	{
+		log_msg("send queue %d full, dropping batch count=%d\n", PRIO_CLIENT, count);
+		return SEND_QUEUE_FULL;
+	}
+
+	if (tag)
+	{
+		ibus_remove_tag_from_queue(tag);
+	}
+
+	log_msg_with_hex(frames, length, "send batch count=%d tag=%d data=", count, tag);
+
+	batch = pool.free_batch;
+	pool.free_batch = batch->next;
+	batch->remaining = count;
+	batch->unsent = count;
+	batch->status = TX_ECHOED;
+	batch->cookie = cookie;
+
+	for (i = 0, pos = 0; i < count; i++)
+	{
+		pkt = ibus_pool_get();
+		ibus_init_packet(pkt, frames + pos, frames[pos + 1] + 2, sync && i == 0, PRIO_CLIENT, tag, 0);
+		pkt->batch = batch;
+		ibus_link_packet(pkt);
+		pos += frames[pos + 1] + 2;
+	}
+
+	ibus_tx_schedule();
+
+	return 0;
 }
@@ -3,10 +3,24 @@
 #define TAG_TIME	3
 #define TAG_DATE	4
 #define TAG_LEDS	5
+#define TAG_CLIENT	0x100	/* + connection id << 8 + the tag a server client asked for */
 
-bool ibus_service_queue(int ifd, bool can_send, int gpio_number, bool *giveup);
+/* transmit queues, realtime always goes first, the others take turns */
+#define PRIO_REALTIME	0	/* protocol replies somebody on the bus is waiting for */
+#define PRIO_CONTROL	1	/* our own housekeeping */
+#define PRIO_CLIENT	2	/* frames from server clients */
+#define PRIO_COUNT	3
+
+/* ibus_send*() return value when that class's queue is full */
+#define SEND_QUEUE_FULL	3
+
+void ibus_tx_init(int ifd, int gpio_number);
+void ibus_tx_bus_active(uint64_t now);
+void ibus_tx_config(int gap, int burst, int queue);
 void ibus_remove_from_queue(const unsigned char *msg, int length);
 void ibus_remove_tag_from_queue(int tag);
 void ibus_discard_queue(void);
-void ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number);
-void ibus_send_with_tag(int ifd, const unsigned char *msg, int length, int gpio_number, bool sync, bool prepend, int tag);
+int ibus_send(int ifd, const unsigned char *msg, int length, int gpio_number);
+int ibus_send_with_cookie(int ifd, const unsigned char *msg, int length, int gpio_number, uint64_t cookie);
+int ibus_send_batch(int ifd, const unsigned char *frames, int length, int gpio_number, bool sync, int tag, uint64_t cookie);
+int ibus_send_with_tag(int ifd, const unsigned char *msg, int length, int gpio_number, bool sync, int prio, int tag);
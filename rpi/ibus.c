@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <linux/serial.h>
+#include <sys/inotify.h>
 #include <pwd.h>
 
 #include "keyboard.h"
@@ -29,6 +30,8 @@
 #include "ibus-send.h"
 #include "ibus.h"
 #include "server.h"
+#include "shmring.h"
+#include "capture.h"
 #include "log.h"
 
 #define SOURCE 0
@@ -77,15 +80,21 @@ static struct
 	bool z4_keymap;
 
 	input_t input;
-	uint64_t last_byte;
-	int bufPos;
-	unsigned char buf[192];
+	uint64_t last_byte;	/* microseconds */
+
+	/* receive window, bytes rx[rx_start] to rx[rx_end - 1] aren't framed yet */
+	int rx_start;
+	int rx_end;
+	int rx_resync;		/* recovering from a corrupt frame up to here */
+	unsigned char rx[1024];
+	unsigned char rx_xor[1025];	/* rx_xor[n] = rx[0] ^ ... ^ rx[n - 1] */
 	char *port_name;
 	int ifd;
 	int ifd_tag;
+	int flush_tag;
 	int read_msgs;
-	int bytes_read;
 	int cdc_info_tag;
+	int tick_tag;
 	int cdc_info_interval;
 	int cdc_timeouts;
 	int gpio_number;
@@ -127,14 +136,18 @@ ibus =
 
 	.input = INPUT_CDC,
 	.last_byte = 0,
-	.bufPos = 0,
-	.buf = {0,},
+	.rx_start = 0,
+	.rx_end = 0,
+	.rx_resync = 0,
+	.rx = {0,},
+	.rx_xor = {0,},
 	.port_name = NULL,
 	.ifd = -1,
 	.ifd_tag = -1,
+	.flush_tag = -1,
 	.read_msgs = 0,
-	.bytes_read = 0,
 	.cdc_info_tag = -1,
+	.tick_tag = -1,
 	.cdc_info_interval = 0,
 	.cdc_timeouts = 0,
 	.gpio_number = 0,
@@ -295,7 +308,7 @@ static void ibus_handle_temps(const unsigned char *data, int length)
 		RODATA flash_leds[]  = "\xc8\x04\xe7\x2b\x3f\x3f";
 
 		ibus_remove_tag_from_queue(TAG_LEDS);
-		ibus_send_with_tag(ibus.ifd, flash_leds, 6, ibus.gpio_number, FALSE, FALSE, TAG_LEDS);
+		ibus_send_with_tag(ibus.ifd, flash_leds, 6, ibus.gpio_number, FALSE, PRIO_CONTROL, TAG_LEDS);
 
 		ibus.high_coolant_count = 999;
 		return;
@@ -304,32 +317,13 @@ static void ibus_handle_temps(const unsigned char *data, int length)
 	ibus.high_coolant_count++;
 }
 
-static bool ibus_good_checksum(const unsigned char *msg, int length)
-{
-	unsigned char sum;
-	int i;
-
-	sum = msg[0];
-	for (i = 1; i < (length - 1); i++)
-	{
-		sum ^= msg[i];
-	}
-
-	if (sum != msg[length - 1])
-	{
-		return FALSE;
-	}
-
-	return TRUE;
-}
-
 static void ibus_request_time(void)
 {
 	/* CDChanger asks IKE for Time */
 	RODATA rt[] = "\x18\x05\x80\x41\x01\x01\xDC";
 
 	ibus_remove_tag_from_queue(TAG_TIME);
-	ibus_send_with_tag(ibus.ifd, rt, 7, ibus.gpio_number, FALSE, FALSE, TAG_TIME);
+	ibus_send_with_tag(ibus.ifd, rt, 7, ibus.gpio_number, FALSE, PRIO_CONTROL, TAG_TIME);
 }
 
 static void ibus_request_date(void)
@@ -338,7 +332,7 @@ static void ibus_request_date(void)
 	RODATA rd[] = "\x18\x05\x80\x41\x02\x01\xDF";
 
 	ibus_remove_tag_from_queue(TAG_DATE);
-	ibus_send_with_tag(ibus.ifd, rd, 7, ibus.gpio_number, FALSE, FALSE, TAG_DATE);
+	ibus_send_with_tag(ibus.ifd, rd, 7, ibus.gpio_number, FALSE, PRIO_CONTROL, TAG_DATE);
 }
 
 static void ibus_set_time_and_date(bool change_date, bool change_time)
@@ -552,11 +546,11 @@ static void cdchanger_send_inforeq(void)
 	if (ibus.playing)
 	{
 		/* This un-mutes the line-in */
-		ibus_send_with_tag(ibus.ifd, start_playing, 12, ibus.gpio_number, TRUE, TRUE, TAG_CDC);
+		ibus_send_with_tag(ibus.ifd, start_playing, 12, ibus.gpio_number, TRUE, PRIO_REALTIME, TAG_CDC);
 	}
 	else
 	{
-		ibus_send_with_tag(ibus.ifd, not_playing, 12, ibus.gpio_number, TRUE, TRUE, TAG_CDC);
+		ibus_send_with_tag(ibus.ifd, not_playing, 12, ibus.gpio_number, TRUE, PRIO_REALTIME, TAG_CDC);
 	}
 
 	/* No more announcements */
@@ -598,7 +592,9 @@ static void cdchanger_handle_inforeq(const unsigned char *msg, int length)
 			mainloop_timeout_remove(ibus.cdc_info_tag);
 		}
 
-		ibus.cdc_info_tag = mainloop_timeout_add(ibus.cdc_info_interval * 1000, cdchanger_interval_timeout, NULL);
+		/* a late one counts as the next one, don't follow it up straight away */
+		ibus.cdc_info_tag = mainloop_timeout_add_policy(ibus.cdc_info_interval * 1000, TIMER_COALESCE,
+					cdchanger_interval_timeout, NULL);
 	}
 }
 
@@ -627,7 +623,7 @@ static void cdchanger_handle_stop(const unsigned char *msg, int length)
 	}
 
 	ibus_remove_tag_from_queue(TAG_CDC);
-	ibus_send_with_tag(ibus.ifd, not_playing, 12, ibus.gpio_number, TRUE, TRUE, TAG_CDC);
+	ibus_send_with_tag(ibus.ifd, not_playing, 12, ibus.gpio_number, TRUE, PRIO_REALTIME, TAG_CDC);
 	ibus.playing = FALSE;
 
 	if (ibus.cdc_info_tag != -1)
@@ -645,7 +641,7 @@ static void cdchanger_handle_pause(const unsigned char *msg, int length)
 	}
 
 	ibus_remove_tag_from_queue(TAG_CDC);
-	ibus_send_with_tag(ibus.ifd, pause_playing, 12, ibus.gpio_number, TRUE, TRUE, TAG_CDC);
+	ibus_send_with_tag(ibus.ifd, pause_playing, 12, ibus.gpio_number, TRUE, PRIO_REALTIME, TAG_CDC);
 	ibus.playing = FALSE;
 }
 
@@ -656,7 +652,7 @@ static void cdchanger_handle_start(const unsigned char *msg, int length)
 		return;
 	}
 
-	ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number);
+	ibus_send_with_tag(ibus.ifd, start_playing, 12, ibus.gpio_number, FALSE, PRIO_REALTIME, 0);
 	ibus.playing = TRUE;
 }
 
@@ -685,7 +681,7 @@ static void cdchanger_handle_diskchange(const unsigned char *msg, int length)
 
 	if (ibus.input == INPUT_CDC)
 	{
-		ibus_send(ibus.ifd, start_playing, 12, ibus.gpio_number);
+		ibus_send_with_tag(ibus.ifd, start_playing, 12, ibus.gpio_number, FALSE, PRIO_REALTIME, 0);
 	}
 }
 
@@ -698,7 +694,7 @@ static void cdchanger_handle_poll(const unsigned char *msg, int length)
 
 	RODATA cdc_im_here[] = "\x18\x04\xFF\x02\x00\xE1";
 
-	ibus_send(ibus.ifd, cdc_im_here, 6, ibus.gpio_number);
+	ibus_send_with_tag(ibus.ifd, cdc_im_here, 6, ibus.gpio_number, FALSE, PRIO_REALTIME, 0);
 }
 
 /*
@@ -713,7 +709,7 @@ static void cdchanger_announce()
 	if (ibus.cdc_announce)
 	{
 		RODATA cdc_announce[] = "\x18\x04\xFF\x02\x01\xE0";
-		ibus_send(ibus.ifd, cdc_announce, 6, ibus.gpio_number);
+		ibus_send_with_tag(ibus.ifd, cdc_announce, 6, ibus.gpio_number, FALSE, PRIO_REALTIME, 0);
 
 		/* Don't do it again */
 		ibus.cdc_announce = FALSE;
@@ -744,8 +740,221 @@ static void ibus_handle_tape(const unsigned char *buf, int length)
 	}
 }
 
+/* every events[] entry and CDC signature matches at least source, length, destination and command */
+#define DISPATCH_SIZE 64
+#define DISPATCH_HASH(msg) (((msg)[SOURCE] ^ ((msg)[DEST] << 1) ^ ((msg)[DATA] << 2)) & (DISPATCH_SIZE - 1))
+
+#define CDC_BIN_DIR "/storage"
+#define CDC_BIN_NAME "pibus-cdc.bin"
+
+typedef struct
+{
+	int length;
+	const unsigned char *msg;
+	const char *desc;
+}
+cdc_signature;
+
+/* CDC screen messages that must match exactly */
+static const cdc_signature cdc_builtin[] =
+{
+	/* USA 1998 750iL (AlpineWhiteV12) */
+	{14, (const unsigned char *)"\x68\x0c\x3b\x23\xc4\x20\x43\x44\x20\x31\x2d\x30\x34\xa7", "US CD 1-04"},
+
+	/* Norway 2004 E83 MK4 (WazKid) */
+	{15, (const unsigned char *)"\x68\x0d\x3b\x23\x62\x10\x43\x44\x43\x20\x31\x2d\x30\x34\x73", "E83 CDC 1-04"},
+
+	/* Spain E39 530d MK2 (phantrax) */
+	{18, (const unsigned char *)"\x68\x10\x3b\x23\xc4\x30\x43\x44\x20\x31\x2d\x30\x34\x20\x20\x20\x20\xab", "E39 CD 1-04"},
+
+	/* Germany X3 (Tom Z.) */
+	{12, (const unsigned char *)"\x68\x0a\x3b\x23\x62\x10\x54\x52\x20\x30\x34\x2a", "X3 TR 04"},
+};
+
+#define NUM_CDC_BUILTIN (sizeof(cdc_builtin) / sizeof(cdc_builtin[0]))
+
+/* built in signatures followed by the ones from pibus-cdc.bin */
+static struct
+{
+	cdc_signature *sigs;
+	int count;
+	unsigned char *file;	/* pibus-cdc.bin contents */
+	short first[DISPATCH_SIZE];
+	short *next;
+	int inotify_fd;
+	int inotify_tag;
+}
+cdc =
+{
+	.sigs = NULL,
+	.count = 0,
+	.file = NULL,
+	.next = NULL,
+	.inotify_fd = -1,
+	.inotify_tag = -1,
+};
+
+
+/* pibus-cdc.bin holds one or more raw IBUS messages, back to back */
+
+static int cdc_read_file(unsigned char **data)
+{
+	struct stat st;
+	int len;
+	int fd;
+
+	*data = NULL;
+
+	fd = open(CDC_BIN_DIR "/" CDC_BIN_NAME, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return 0;
+	}
+
+	len = 0;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= 4096)
+	{
+		*data = malloc(st.st_size);
+		len = read(fd, *data, st.st_size);
+		if (len != st.st_size)
+		{
+			len = 0;
+		}
+	}
+	close(fd);
+
+	if (len == 0)
+	{
+		free(*data);
+		*data = NULL;
+	}
+
+	return len;
+}
+
+static void cdc_load_signatures(void)
+{
+	unsigned char *file;
+	int file_len;
+	int pos, len;
+	int i, h;
+
+	free(cdc.sigs);
+	free(cdc.next);
+	free(cdc.file);
+
+	file_len = cdc_read_file(&file);
+	cdc.file = file;
+
+	/* every custom message is at least 4 bytes */
+	cdc.sigs = malloc((NUM_CDC_BUILTIN + (file_len / 4)) * sizeof(cdc_signature));
+	memcpy(cdc.sigs, cdc_builtin, sizeof(cdc_builtin));
+	cdc.count = NUM_CDC_BUILTIN;
+
+	for (pos = 0; pos + LENGTH < file_len; pos += len)
+	{
+		len = file[pos + LENGTH] + 2;
+		if (len < 4 || pos + len > file_len)
+		{
+			log_msg("CDC: bad message in " CDC_BIN_NAME " at offset %d\n", pos);
+			break;
+		}
+
+		cdc.sigs[cdc.count].length = len;
+		cdc.sigs[cdc.count].msg = file + pos;
+		cdc.sigs[cdc.count].desc = "CDC BIN";
+		cdc.count++;
+	}
+
+	if (cdc.count > NUM_CDC_BUILTIN)
+	{
+		log_msg("CDC: loaded %d messages from " CDC_BIN_NAME "\n", cdc.count - (int)NUM_CDC_BUILTIN);
+	}
+
+	/* same buckets as events[], in table order */
+	cdc.next = malloc(cdc.count * sizeof(short));
+	for (h = 0; h < DISPATCH_SIZE; h++)
+	{
+		cdc.first[h] = -1;
+	}
+	for (i = cdc.count - 1; i >= 0; i--)
+	{
+		h = DISPATCH_HASH(cdc.sigs[i].msg);
+		cdc.next[i] = cdc.first[h];
+		cdc.first[h] = i;
+	}
+}
+
+static const char *cdc_lookup(const unsigned char *msg, int length)
+{
+	int i;
+
+	for (i = cdc.first[DISPATCH_HASH(msg)]; i != -1; i = cdc.next[i])
+	{
+		if (cdc.sigs[i].length == length && memcmp(msg, cdc.sigs[i].msg, length) == 0)
+		{
+			return cdc.sigs[i].desc;
+		}
+	}
+
+	return NULL;
+}
+
+static void cdc_inotify_read(int condition, void *unused)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool reload = FALSE;
+	int len;
+	char *p;
+
+	while ((len = read(cdc.inotify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *) p;
+			if (ev->len && strcmp(ev->name, CDC_BIN_NAME) == 0)
+			{
+				reload = TRUE;
+			}
+		}
+	}
+
+	if (reload)
+	{
+		cdc_load_signatures();
+	}
+}
+
+/* load the CDC signatures once, then only again when pibus-cdc.bin changes */
+
+static void cdc_init(void)
+{
+	/* whether or not we get to watch for changes */
+	cdc_load_signatures();
+
+	cdc.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cdc.inotify_fd == -1)
+	{
+		log_msg("cdc: inotify_init1 failed, %s won't be reloaded: %s\n", CDC_BIN_NAME, strerror(errno));
+		return;
+	}
+
+	if (inotify_add_watch(cdc.inotify_fd, CDC_BIN_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) == -1)
+	{
+		log_msg("cdc: can't watch %s, %s won't be reloaded: %s\n", CDC_BIN_DIR, CDC_BIN_NAME, strerror(errno));
+		close(cdc.inotify_fd);
+		cdc.inotify_fd = -1;
+		return;
+	}
+
+	cdc.inotify_tag = mainloop_input_add(cdc.inotify_fd, FIA_READ, cdc_inotify_read, NULL);
+}
+
 static bool is_cdc_message(const unsigned char *buf, int length)
 {
+	const char *desc;
+
 	/* Copied from attiny code */
 
 	if (length == 20 &&
@@ -783,80 +992,14 @@ static bool is_cdc_message(const unsigned char *buf, int length)
 		return TRUE;
 	}
 
-	/* USA 1998 750iL (AlpineWhiteV12) */
-	if (length == 14 &&
-		memcmp(buf, "\x68\x0c\x3b\x23\xc4\x20\x43\x44\x20\x31\x2d\x30\x34\xa7", 14) == 0)
-	{
-		log_msg("CDC: %s\n", "US CD 1-04");
-		return TRUE;
-	}
-
-	/* Norway 2004 E83 MK4 (WazKid) */
-	if (length == 15 &&
-		memcmp(buf, "\x68\x0d\x3b\x23\x62\x10\x43\x44\x43\x20\x31\x2d\x30\x34\x73", 15) == 0)
-	{
-		log_msg("CDC: %s\n", "E83 CDC 1-04");
-		return TRUE;
-	}
-
-	/* Spain E39 530d MK2 (phantrax) */
-	if (length == 18 &&
-		memcmp(buf, "\x68\x10\x3b\x23\xc4\x30\x43\x44\x20\x31\x2d\x30\x34\x20\x20\x20\x20\xab", 18) == 0)
-	{
-		log_msg("CDC: %s\n", "E39 CD 1-04");
-		return TRUE;
-	}
-
-	/* Germany X3 (Tom Z.) */
-	if (length == 12 &&
-		memcmp(buf, "\x68\x0a\x3b\x23\x62\x10\x54\x52\x20\x30\x34\x2a", 12) == 0)
+	/* an exact match on one of the known messages? */
+	desc = cdc_lookup(buf, length);
+	if (desc)
 	{
-		log_msg("CDC: %s\n", "X3 TR 04");
+		log_msg("CDC: %s\n", desc);
 		return TRUE;
 	}
 
-	{
-		static bool have_bin_msg = FALSE;
-		static unsigned char cdc_msg[64];
-		static int cdc_len;
-
-		struct stat st;
-		int len;
-		int fd;
-
-		if (!have_bin_msg)
-		{
-			fd = open("/storage/pibus-cdc.bin", O_RDONLY);
-			if (fd != -1)
-			{
-				if (fstat(fd, &st) == 0)
-				{
-					len = st.st_size;
-					if (len > sizeof (cdc_msg))
-					{
-						len = sizeof (cdc_msg);
-					}
-					if (read(fd, cdc_msg, len) == len)
-					{
-						have_bin_msg = TRUE;
-						cdc_len = len;
-					}
-				}
-				close(fd);
-			}
-		}
-
-		if (have_bin_msg)
-		{
-			if (length == cdc_len &&
-			    memcmp(buf, cdc_msg, length) == 0)
-			{
-				log_msg("CDC: %s\n", "CDC BIN");
-				return TRUE;
-			}
-		}
-	}
-
 	return FALSE;
 }
 
@@ -1077,12 +1220,36 @@ events[] =
 #endif
 };
 
+#define NUM_EVENTS (sizeof(events) / sizeof(events[0]))
+
+/* events[] indexes bucketed on source, destination and command, each bucket in table order */
+static short dispatch_first[DISPATCH_SIZE];
+static short dispatch_next[NUM_EVENTS];
+
+
+static void ibus_build_dispatch(void)
+{
+	int i, h;
+
+	for (h = 0; h < DISPATCH_SIZE; h++)
+	{
+		dispatch_first[h] = -1;
+	}
+
+	/* go backwards so the first match in the table stays first in its bucket */
+	for (i = NUM_EVENTS - 1; i >= 0; i--)
+	{
+		h = DISPATCH_HASH((const unsigned char *)events[i].ibusmsg);
+		dispatch_next[i] = dispatch_first[h];
+		dispatch_first[h] = i;
+	}
+}
 
-static void ibus_handle_message(const unsigned char *msg, int length, const char *suffix, bool recovered)
+static void ibus_handle_message(const unsigned char *msg, int length, bool recovered)
 {
 	int i;
 
-	log_ibus(msg, length, suffix);
+	log_ibus(msg, length, recovered ? CAPTURE_RECOVER : CAPTURE_RX);
 
 	server_handle_message(msg, length);
 
@@ -1103,7 +1270,7 @@ static void ibus_handle_message(const unsigned char *msg, int length, const char
 
 	ibus.read_msgs++;
 
-	if (ibus.input != INPUT_NONE) for (i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+	if (ibus.input != INPUT_NONE) for (i = dispatch_first[DISPATCH_HASH(msg)]; i != -1; i = dispatch_next[i])
 	{
 		if (events[i].match_length > length)
 		{
@@ -1137,141 +1304,176 @@ static void ibus_handle_message(const unsigned char *msg, int length, const char
 	}
 }
 
-static void ibus_discard_bytes(int number_of_bytes)
+static int ibus_rx_pending(void)
 {
-	ibus.bufPos -= number_of_bytes;
-
-	/* bug? */
-	if (ibus.bufPos < 0)
-	{
-		ibus.bufPos = 0;
-	}
-	else if (ibus.bufPos)
-	{
-		memmove(ibus.buf, ibus.buf + number_of_bytes, ibus.bufPos);
-	}
+	return ibus.rx_end - ibus.rx_start;
 }
 
-static bool ibus_discard_receive_buffer(void)
+/*
+ * Frame whatever is in the receive window. Frames are handed on as pointers
+ * into the window, nothing gets copied. A frame is good when the XOR of all
+ * its bytes (checksum included) is zero, which rx_xor gives us in O(1).
+ *
+ * After a corrupt frame we slide through it one byte at a time, passing on
+ * any good frames found as "recover". A flush does the same with everything
+ * left in the window and then throws away what couldn't be framed.
+ */
+static void ibus_rx_frame(bool flush)
 {
+	const unsigned char *msg;
+	bool recovering;
+	int start;
 	int len;
-	bool recovered = FALSE;
 
-	while (ibus.bufPos >= 5)
+	if (flush)
 	{
-		/* discard the 1st byte and try again */
-		ibus_discard_bytes(1);
+		ibus.rx_resync = ibus.rx_end;
+	}
 
-		len = ibus.buf[LENGTH] + 2;
+	while (ibus_rx_pending() > LENGTH)
+	{
+		start = ibus.rx_start;
+		msg = ibus.rx + start;
+		len = msg[LENGTH] + 2;
+		recovering = (start < ibus.rx_resync);
 
-		while (len >= 4 && len <= ibus.bufPos && ibus_good_checksum(ibus.buf, len))
+		if (len < 4)
 		{
-			recovered = TRUE;
-
-			ibus_handle_message(ibus.buf, len, "recover", TRUE);
-			ibus_discard_bytes(len);
+			/* can't be the start of a frame */
+			ibus.rx_start++;
+			continue;
+		}
 
-			if (!(ibus.bufPos >= 5))
+		if (ibus_rx_pending() < len)
+		{
+			if (!recovering)
 			{
+				/* wait for the rest of it */
 				break;
 			}
 
-			len = ibus.buf[LENGTH] + 2;
+			ibus.rx_start++;
+			continue;
 		}
-	}
-
-	ibus.bufPos = 0;
-
-	return recovered;
-}
-
-static void ibus_read(int condition, void *unused)
-{
-	unsigned char c;
-	uint64_t now;
-	int r;
 
-	while (1)
-	{
-		if ((r = read(ibus.ifd, &c, 1)) != 1)
+		if (ibus.rx_xor[start] == ibus.rx_xor[start + len])
 		{
-			if (r == -1)
-			{
-				int e = errno;
-				if (e != EWOULDBLOCK)
-				{
-					printf("ifd=%d e=%d %s\n", ibus.ifd, e, strerror(e));
-					exit(1);
-				}
-			}
-			return;
+			ibus.rx_start += len;
+			ibus_handle_message(msg, len, recovering);
+			continue;
 		}
 
-		now = mainloop_get_millisec();
-
-		if (now - ibus.last_byte > 64 && ibus.bufPos)
+		if (!recovering)
 		{
-			log_msg_with_hex(ibus.buf, ibus.bufPos, "ibus_read(): discard %d: ", ibus.bufPos);
-			ibus_discard_receive_buffer();
+			log_ibus(msg, len, CAPTURE_CORRUPT);
+			ibus.rx_resync = start + len;
 		}
-		ibus.last_byte = now;
 
-		ibus.buf[ibus.bufPos] = c;
-		if (ibus.bufPos < (sizeof(ibus.buf) - 1))
-		{
-			ibus.bufPos++;
-		}
+		/* discard the 1st byte and try again */
+		ibus.rx_start++;
+	}
 
-		ibus.bytes_read++;
+	if (flush)
+	{
+		ibus.rx_start = ibus.rx_end;
+	}
+}
 
-retry:
-		if (ibus.bufPos >= 4 && (ibus.buf[LENGTH] + 2) == ibus.bufPos)
-		{
-			if (!ibus_good_checksum(ibus.buf, ibus.bufPos))
-			{
-				log_ibus(ibus.buf, ibus.bufPos, "corrupt");
+static void ibus_rx_flush(const char *who)
+{
+	log_msg_with_hex(ibus.rx + ibus.rx_start, ibus_rx_pending(), "%s(): discard %d: ", who, ibus_rx_pending());
+	ibus_rx_frame(TRUE);
+}
+
+/* armed while the receive window holds a partial frame */
+
+static int ibus_flush_timeout(void *unused)
+{
+	uint64_t idle;
 
-				while (ibus.bufPos >= 5)
-				{
-					/* discard the 1st byte and try again */
-					ibus_discard_bytes(1);
+	ibus.flush_tag = -1;
+
+	if (ibus_rx_pending() == 0)
+	{
+		return 0;
+	}
 
-					int len = ibus.buf[LENGTH] + 2;
-					bool recovered = FALSE;
+	/* this'll hardly ever happen */
+	idle = (mainloop_get_microsec() - ibus.last_byte) / 1000;
+	if (idle >= 200)
+	{
+		ibus_rx_flush("ibus_flush_timeout");
+		return 0;
+	}
 
-					while (len <= ibus.bufPos && ibus_good_checksum(ibus.buf, len))
-					{
-						recovered = TRUE;
+	ibus.flush_tag = mainloop_timeout_add(200 - idle, ibus_flush_timeout, NULL);
 
-						ibus_handle_message(ibus.buf, len, "recover", TRUE);
-						ibus_discard_bytes(len);
+	return 0;
+}
 
-						if (!(ibus.bufPos >= 4))
-						{
-							//ibus.bufPos = 0;
-							break;
-						}
+/* take everything the UART has in one go, the mainloop calls us again if there's more */
 
-						len = ibus.buf[LENGTH] + 2;
-					}
+static void ibus_read(int condition, void *unused)
+{
+	uint64_t now;
+	int pending;
+	int i, r;
 
-					if (recovered)
-					{
-						goto retry;
-					}
-				}
+	/* keep room for a full read at the end of the window */
+	pending = ibus_rx_pending();
+	if (pending == 0)
+	{
+		ibus.rx_start = ibus.rx_end = 0;
+		ibus.rx_resync = 0;
+	}
+	else if (ibus.rx_end > sizeof(ibus.rx) - 256)
+	{
+		/* at most one partial frame, so this is rare and short */
+		memmove(ibus.rx, ibus.rx + ibus.rx_start, pending);
+		memmove(ibus.rx_xor, ibus.rx_xor + ibus.rx_start, pending + 1);
+		ibus.rx_resync = (ibus.rx_resync > ibus.rx_start) ? ibus.rx_resync - ibus.rx_start : 0;
+		ibus.rx_start = 0;
+		ibus.rx_end = pending;
+	}
 
-				/* bad... improve this path! */
-			}
-			else
+	r = read(ibus.ifd, ibus.rx + ibus.rx_end, sizeof(ibus.rx) - ibus.rx_end);
+	if (r <= 0)
+	{
+		if (r == -1)
+		{
+			int e = errno;
+			if (e != EWOULDBLOCK)
 			{
-				ibus_handle_message(ibus.buf, ibus.bufPos, "", FALSE);
+				printf("ifd=%d e=%d %s\n", ibus.ifd, e, strerror(e));
+				exit(1);
 			}
-
-			ibus.bufPos = 0;
 		}
+		return;
 	}
 
+	/* at 9600 baud, bytes from the same read() arrived close enough together */
+	now = mainloop_get_microsec();
+
+	if (now - ibus.last_byte > 64000 && ibus_rx_pending())
+	{
+		ibus_rx_flush("ibus_read");
+	}
+	ibus.last_byte = now;
+
+	for (i = ibus.rx_end; i < ibus.rx_end + r; i++)
+	{
+		ibus.rx_xor[i + 1] = ibus.rx_xor[i] ^ ibus.rx[i];
+	}
+	ibus.rx_end += r;
+	ibus_tx_bus_active(now);
+
+	ibus_rx_frame(FALSE);
+
+	/* make sure a partial frame gets flushed if the bus goes quiet */
+	if (ibus_rx_pending() && ibus.flush_tag == -1)
+	{
+		ibus.flush_tag = mainloop_timeout_add(200, ibus_flush_timeout, NULL);
+	}
 }
 
 static int ibus_init_serial_port(bool have_log)
@@ -1286,13 +1488,14 @@ static int ibus_init_serial_port(bool have_log)
 		close(ibus.ifd);
 	}
 
-	ibus.ifd = open(ibus.port_name, O_RDWR | O_NOCTTY | O_SYNC);
+	ibus.ifd = open(ibus.port_name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
 	if (ibus.ifd == -1)
 	{
 		if (have_log)
 			log_msg("Can't open ibus [%s] %s\n", ibus.port_name, strerror(errno));
 		else
 			fprintf(stderr, "Can't open ibus [%s] %s\n", ibus.port_name, strerror(errno));
+		ibus_tx_init(-1, ibus.gpio_number);
 		return -1;
 	}
 
@@ -1313,6 +1516,7 @@ static int ibus_init_serial_port(bool have_log)
 	ioctl(ibus.ifd, TIOCSSERIAL, &ser);
 
 	ibus.ifd_tag = mainloop_input_add(ibus.ifd, FIA_READ, ibus_read, NULL);
+	ibus_tx_init(ibus.ifd, ibus.gpio_number);
 
 	return 0;
 }
@@ -1322,6 +1526,16 @@ static int ibus_init_serial_port(bool have_log)
 static int ibus_1s_tick(void *unused)
 {
 	static int i = 0;
+	static int missed = 0;
+	int m;
+
+	/* something held up the mainloop for whole seconds */
+	m = mainloop_timeout_missed(ibus.tick_tag);
+	if (m != missed)
+	{
+		log_msg("mainloop fell behind, %d ticks missed\n", m - missed);
+		missed = m;
+	}
 
 	i++;
 	if (i >= 30)
@@ -1358,7 +1572,7 @@ static int ibus_1s_tick(void *unused)
 	}
 
 	/* 5 minute idle timeout */
-	if (mainloop_get_millisec() - ibus.last_byte > ibus.idle_timeout * 1000)
+	if (mainloop_get_microsec() - ibus.last_byte > ibus.idle_timeout * 1000000ULL)
 	{
 		log_msg("idle timeout\n");
 		power_off();
@@ -1367,89 +1581,47 @@ static int ibus_1s_tick(void *unused)
 	return 1;
 }
 
-static void ibus_update_leds()
+/* only runs on boards with a LED, re-arms itself for the next on/off edge */
+
+static int ibus_update_leds(void *unused)
 {
-	static int i = 0;
+	static int step = 0;
 
-	i++;
-	if ((ibus.read_msgs && i >= 20) || i >= 60)
-	{
-		i = 0;
-	}
+	/* on/off times in ms, starting with on */
+	static const int single_blink[] = {100, 900};
+	static const int double_blink[] = {100, 200, 100, 2600};
 
-	if (ibus.hw_version >= 4)
+	const int *pattern;
+	int steps;
+
+	if (ibus.read_msgs)
 	{
-		if (ibus.read_msgs)
-		{
-			/* single blink */
-			gpio_write(GPIO_LED_CTL, (i < 2) ? 1 : 0);
-		}
-		else
-		{
-			/* double blink */
-			gpio_write(GPIO_LED_CTL, ((i < 2) || (i > 5 && i < 8)) ? 1 : 0);
-		}
+		pattern = single_blink;
+		steps = sizeof(single_blink) / sizeof(single_blink[0]);
 	}
-}
-
-/* every 50ms */
-
-static int ibus_50ms_tick(void *unused)
-{
-	bool can_send;
-	uint64_t now;
-	bool giveup;
-
-	ibus_update_leds();
-
-	/* this'll hardly ever happen */
-	if (ibus.bufPos)
+	else
 	{
-		now = mainloop_get_millisec();
-		if (now - ibus.last_byte > 200)
-		{
-			log_msg_with_hex(ibus.buf, ibus.bufPos, "ibus_50ms_tick(): discard %d: ", ibus.bufPos);
-			ibus_discard_receive_buffer();
-		}
+		pattern = double_blink;
+		steps = sizeof(double_blink) / sizeof(double_blink[0]);
 	}
 
-	if (/*ibus.gpio_number > 0*/1)
+	if (step >= steps)
 	{
-		if (ibus.bytes_read == 0)
-		{
-			can_send = TRUE;
-		}
-		else
-		{
-			can_send = FALSE;
-		}
+		step = 0;
+	}
 
-		if (ibus_service_queue(ibus.ifd, can_send, ibus.gpio_number, &giveup))
-		{
-			/* Unexpected: GPIO was low or RX FIFO not empty :( */
-		}
+	gpio_write(GPIO_LED_CTL, (step & 1) ? 0 : 1);
+	mainloop_timeout_add(pattern[step], ibus_update_leds, NULL);
+	step++;
 
-		if (giveup)
-		{
-			log_msg("serial port is broken - reopening\n");
-			//ibus_discard_queue();
-			ibus_init_serial_port(TRUE);
-		}
+	return 0;
+}
 
-		if (ibus.bufPos == 0 && !can_send)
-		{
-			/* restart the counter */
-			ibus.bytes_read = 0;
-
-			/*
-			 * Now wait for ibus_50ms_tick() to be called again.
-			 * If no bytes were read during this 50ms, we can transmit.
-			 *
-			 */
-		}
-	}
+/* ibus-send.c gave up waiting for an echo */
 
-	return 1;
+void ibus_reopen_port(void)
+{
+	ibus_init_serial_port(TRUE);
 }
 
 int ibus_send_ascii(const char *cmd)
@@ -1472,23 +1644,36 @@ int ibus_send_ascii(const char *cmd)
 		data[j] = strtoul(byte, NULL, 16);
 	}
 
+	return ibus_send_frame(data, j, 0);
+}
+
+/* several frames back to back, see ibus_send_batch() */
+
+int ibus_send_frames(const unsigned char *frames, int length, bool sync, int tag, uint64_t cookie)
+{
+	return ibus_send_batch(ibus.ifd, frames, length, ibus.gpio_number, sync, tag, cookie);
+}
+
+/* a whole frame, the checksum byte gets filled in. cookie is passed back to server_notify_done() */
+
+int ibus_send_frame(const unsigned char *data, int length, uint64_t cookie)
+{
 	/* length error? */
-	if (data[1] + 2 != j || j < 5 || j > 255)
+	if (length < 5 || length > 255 || data[1] + 2 != length)
 	{
 		return 2;
 	}
 
-	ibus_send(ibus.ifd, data, j, ibus.gpio_number);
-
-	return 0;
+	return ibus_send_with_cookie(ibus.ifd, data, length, ibus.gpio_number, cookie);
 }
 
-int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool cdc_announce, int cdc_info_interval, int gpio_number, int idle_timeout, int hw_version, int input, bool handle_nextprev, bool rotary_opposite, bool z4_keymap, int server_port, int log_level, int coolant_warning)
+int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool cdc_announce, int cdc_info_interval, int gpio_number, int idle_timeout, int hw_version, int input, bool handle_nextprev, bool rotary_opposite, bool z4_keymap, int server_port, int log_level, bool text_log, int coolant_warning)
 {
 	struct timespec ts;
 
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	ibus.port_name = strdup(port);
+	ibus.gpio_number = gpio_number;
 
 	if (ibus_init_serial_port(FALSE) == -1)
 	{
@@ -1502,7 +1687,7 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 		return -1;
 	}
 
-	if (log_open(ts.tv_sec, log_level) != 0)
+	if (log_open(ts.tv_sec, log_level, text_log) != 0)
 	{
 		fprintf(stderr, "Cannot write to log: %s\n", strerror(errno));
 		mainloop_input_remove(ibus.ifd_tag);
@@ -1515,12 +1700,11 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 	log_msg("startup bt=%d cam=%d anc=%d cdci=%d gpio=%d idle=%d hwv=%d in=%d hnp=%d rop=%d [" __DATE__ "]\n", bluetooth, camera, cdc_announce, cdc_info_interval, gpio_number, idle_timeout, hw_version, input, handle_nextprev, rotary_opposite);
 	log_flush();
 
-	ibus.last_byte = mainloop_get_millisec();
+	ibus.last_byte = mainloop_get_microsec();
 	ibus.bluetooth = bluetooth;
 	ibus.have_camera = camera;
 	ibus.cdc_announce = cdc_announce;
 	ibus.cdc_info_interval = cdc_info_interval;
-	ibus.gpio_number = gpio_number;
 	ibus.idle_timeout = idle_timeout;
 	ibus.hw_version = hw_version;
 	ibus.input = input;
@@ -1529,8 +1713,15 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 	ibus.z4_keymap = z4_keymap;
 	ibus.coolant_warning = coolant_warning;
 
-	mainloop_timeout_add(50, ibus_50ms_tick, NULL);
-	mainloop_timeout_add(1000, ibus_1s_tick, NULL);
+	ibus_build_dispatch();
+	cdc_init();
+
+	ibus.tick_tag = mainloop_timeout_add(1000, ibus_1s_tick, NULL);
+
+	if (hw_version >= 4)
+	{
+		ibus_update_leds(NULL);
+	}
 
 	/* gpio 15 is the UART RX, don't change its direction. */
 	if (gpio_number != 15 && gpio_number != 0)
@@ -1589,10 +1780,9 @@ int ibus_init(const char *port, char *startup, bool bluetooth, bool camera, bool
 		free(startup);
 	}
 
-	if (server_port)
-	{
-		server_init(server_port);
-	}
+	/* port 0 = just the unix socket, if there is one */
+	server_init(server_port);
+	shmring_init();
 
 	return 0;
 }
@@ -1606,5 +1796,6 @@ void ibus_cleanup(void)
 	}*/
 
 	server_cleanup();
+	shmring_cleanup();
 }
 
@@ -18,7 +18,7 @@ int keyboard_init(void)
 	struct uinput_user_dev uidev;
 	int i;
 
-	kfd = open("/dev/uinput", O_WRONLY);
+	kfd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
 	if (kfd < 0)
 		return -1;
 
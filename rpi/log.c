@@ -3,151 +3,634 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <pwd.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <spawn.h>
 
 #include "mainloop.h"
-#include "annotate.h"
+#include "capture.h"
 #include "log.h"
 
 
+/* records the mainloop has produced but the writer hasn't written yet */
+#define LOG_RING_SIZE 256	/* power of 2 */
+
+static struct
+{
+	capture_record rec[LOG_RING_SIZE];
+	unsigned int head;	/* only written by the mainloop */
+	unsigned int tail;	/* only written by the writer thread */
+	unsigned int dropped;
+	bool running;		/* writer thread started, flog belongs to it */
+	bool flush;
+	bool stop;
+	bool woken;
+	pthread_mutex_t lock;	/* for woken */
+	pthread_cond_t wake;	/* CLOCK_MONOTONIC, stime() doesn't disturb it */
+	pthread_t thread;
+}
+ring;
+
 static FILE *flog;
 static time_t log_start;
 static int log_level;
+static bool log_text;		/* ibus.txt instead of ibus.cap */
+static char log_dir[200];
+static const char *log_name;
 
+/* only touched by the writer thread once it's running */
+static struct
+{
+	long max_size;		/* bytes, 0 = no limit */
+	int max_age;		/* seconds, 0 = no limit */
+	int keep;		/* rotated segments to keep */
+	time_t born;		/* time(), when the segment was started */
+	pid_t gzip;
+	unsigned int seq;	/* next segment number, 0 = not looked yet */
+}
+rotate = {16 * 1024 * 1024, 24 * 3600, 8, 0, 0, 0};
 
-static void log_write(char prefix_char, char *fmt, va_list args)
+/* the writer only holds the lock around its wait, so this doesn't wait on the SD card */
+
+static void log_wake(void)
+{
+	pthread_mutex_lock(&ring.lock);
+	ring.woken = TRUE;
+	pthread_cond_signal(&ring.wake);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+
+/* get the next free record, or NULL if the ring is full. Never blocks. */
+
+static capture_record *log_reserve(capture_kind kind)
 {
-	static char buf[512];
 	struct timespec ts;
-	int len;
+	capture_record *rec;
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	len = sprintf(buf, "%6.6lu.%03lu ", ts.tv_sec - log_start, ts.tv_nsec / 1000000);
-	if (prefix_char)
+	if (!ring.running)
 	{
-		buf[len++] = prefix_char;
+		return NULL;
 	}
-	len += vsnprintf(buf + len, sizeof(buf) - (len + 1), fmt, args);
 
-	buf[sizeof(buf) - 1] = '\0';
-	if (len < 0 || len > (sizeof(buf) - 1))
-		len = strlen (buf);
+	if (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+	{
+		__atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	rec = &ring.rec[ring.head & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec->usec = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+	rec->kind = kind;
+	rec->text_len = 0;
+	rec->data_len = 0;
 
-	fwrite(buf, len, 1, flog);
+	return rec;
 }
 
-static void fwrite_hex(FILE *out, const unsigned char *data, int length)
+static void log_commit(void)
 {
-	int i;
+	__atomic_store_n(&ring.head, ring.head + 1, __ATOMIC_RELEASE);
+
+	/* the writer wakes up by itself every 100ms, only hurry it along when filling up */
+	if (ring.head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE / 2)
+	{
+		log_wake();
+	}
+}
+
+static void log_format(capture_record *rec, char *fmt, va_list args)
+{
+	int len;
+
+	len = vsnprintf(rec->text, sizeof(rec->text), fmt, args);
+	if (len < 0)
+		len = 0;
+	else if (len > (sizeof(rec->text) - 1))
+		len = sizeof(rec->text) - 1;
+
+	rec->text_len = len;
+}
 
-	for (i = 0; i < length; i++)
+static void log_data(capture_record *rec, const unsigned char *data, int length)
+{
+	if (length > sizeof(rec->data))
 	{
-		fprintf(out, "%02x", data[i]);
+		length = sizeof(rec->data);
 	}
+
+	memcpy(rec->data, data, length);
+	rec->data_len = length;
 }
 
 void log_msg(char *fmt, ...)
 {
+	capture_record *rec;
 	va_list args;
 
+	rec = log_reserve(CAPTURE_MSG);
+	if (rec == NULL)
+	{
+		return;
+	}
+
 	va_start(args, fmt);
-	log_write('#', fmt, args);
+	log_format(rec, fmt, args);
 	va_end(args);
+
+	log_commit();
 }
 
 void log_msg_with_hex(const unsigned char *data, int length, char *fmt, ...)
 {
+	capture_record *rec;
 	va_list args;
 
+	rec = log_reserve(CAPTURE_MSG_HEX);
+	if (rec == NULL)
+	{
+		return;
+	}
+
 	va_start(args, fmt);
-	log_write('#', fmt, args);
+	log_format(rec, fmt, args);
 	va_end(args);
 
-	fwrite_hex(flog, data, length);
-	fputc('\n', flog);
+	log_data(rec, data, length);
+	log_commit();
 }
 
-void log_ibus(const unsigned char *data, int length, const char *suffix)
+/* kind is one of CAPTURE_RX, CAPTURE_RECOVER, CAPTURE_CORRUPT or CAPTURE_TX */
+
+void log_ibus(const unsigned char *data, int length, int kind)
 {
-	va_list empty;
-	char annotation[512];
+	capture_record *rec;
 
-	if (log_level < 1)
+	if (log_level < 1 && kind != CAPTURE_TX)
 	{
 		return;
 	}
 
-	log_write(0, "", empty);
-	fwrite_hex(flog, data, length);
+	rec = log_reserve(kind);
+	if (rec == NULL)
+	{
+		return;
+	}
 
-	if (log_level)
+	log_data(rec, data, length);
+	log_commit();
+}
+
+/* everything below runs in the writer thread */
+
+static void log_write_record(const capture_record *rec)
+{
+	unsigned char bin[CAPTURE_MAX_RECORD];
+	char text[CAPTURE_MAX_TEXT];
+
+	if (log_text)
+	{
+		fwrite(text, capture_format_text(text, rec, log_start, log_level), 1, flog);
+	}
+	else
 	{
-		fprintf(flog, " %s", annotate_device_to_device(data[0], data[2]));			
+		fwrite(bin, capture_encode(bin, rec), 1, flog);
+	}
+}
 
-		if (log_level >= 2)
+static void log_drain(void)
+{
+	static capture_record note;
+	struct timespec ts;
+	unsigned int head;
+	unsigned int dropped;
+
+	head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	while (ring.tail != head)
+	{
+		log_write_record(&ring.rec[ring.tail & (LOG_RING_SIZE - 1)]);
+		__atomic_store_n(&ring.tail, ring.tail + 1, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_exchange_n(&ring.dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		note.usec = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+		note.kind = CAPTURE_MSG;
+		note.text_len = snprintf(note.text, sizeof(note.text), "log writer fell behind, dropped %u lines\n", dropped);
+		log_write_record(&note);
+	}
+}
+
+/*
+ * Rotated segments are ibus-NNNNNNNN.cap or .txt, maybe .gz. Numbered rather
+ * than dated, the clock jumps whenever the car sets it and there's no RTC.
+ */
+
+#define SEGMENT_DIGITS 8
+
+static int log_segment_filter(const struct dirent *d)
+{
+	return strncmp(d->d_name, "ibus-", 5) == 0 &&
+	       strspn(d->d_name + 5, "0123456789") == SEGMENT_DIGITS && d->d_name[5 + SEGMENT_DIGITS] == '.';
+}
+
+/* one past the newest segment already there */
+
+static unsigned int log_next_segment(void)
+{
+	struct dirent **list;
+	unsigned int seq = 1;
+	int n;
+	int i;
+
+	n = scandir(log_dir, &list, log_segment_filter, alphasort);
+	if (n < 0)
+	{
+		return seq;
+	}
+
+	if (n > 0)
+	{
+		seq = strtoul(list[n - 1]->d_name + 5, NULL, 10) + 1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		free(list[i]);
+	}
+	free(list);
+
+	return seq;
+}
+
+/* remove the oldest rotated segments, ibus-N.cap and ibus-N.cap.gz count as one */
+
+static void log_expire(void)
+{
+	struct dirent **list;
+	char path[512];
+	int segments;
+	int n;
+	int i;
+
+	n = scandir(log_dir, &list, log_segment_filter, alphasort);
+	if (n < 0)
+	{
+		return;
+	}
+
+	segments = 0;
+	for (i = n - 1; i >= 0; i--)
+	{
+		if (i == 0 || strncmp(list[i - 1]->d_name, list[i]->d_name, strlen(list[i - 1]->d_name)) != 0)
+		{
+			segments++;
+		}
+
+		if (segments > rotate.keep)
 		{
-			annotation[0] = 0;
-			annotate_ibus_message(annotation, sizeof(annotation), data, length, (log_level>=3) ? TRUE : FALSE);
-			fprintf(flog, " %s", annotation);
+			snprintf(path, sizeof(path), "%s/%s", log_dir, list[i]->d_name);
+			unlink(path);
 		}
 	}
 
-	if (suffix && suffix[0])
+	for (i = 0; i < n; i++)
 	{
-		fprintf(flog, " %s\n", suffix);
+		free(list[i]);
 	}
-	else
+	free(list);
+}
+
+extern char **environ;
+
+/*
+ * gzip at low priority, one at a time. posix_spawn() rather than fork() from
+ * this thread, and every fd we own is close-on-exec so gzip doesn't hold on
+ * to the serial port or the sockets.
+ */
+
+static void log_compress(const char *path)
+{
+	char *argv[] = {"nice", "-n", "19", "gzip", "-q", (char *)path, NULL};
+
+	if (rotate.gzip > 0)
 	{
-		fputc('\n', flog);
+		return;		/* still busy, leave this one uncompressed */
+	}
+
+	if (posix_spawnp(&rotate.gzip, "nice", NULL, NULL, argv, environ) != 0)
+	{
+		rotate.gzip = 0;
 	}
 }
 
-int log_open(time_t start, int level)
+static void log_write_session(void);
+
+static void log_rotate(void)
 {
-	log_start = start;
-	log_level = level;
+	char path[256];
+	char rotated[256];
+	FILE *f;
+	time_t now;
 
-#ifdef __i386__
-	flog = fopen("./ibus.txt", "a");
-#else
+	if (rotate.gzip > 0 && waitpid(rotate.gzip, NULL, WNOHANG) != 0)
 	{
-		char logfile[256];
-		struct passwd *pw;
+		rotate.gzip = 0;
+	}
 
-		flog = NULL;
-		pw = getpwuid(getuid());
-		if (pw)
+	now = time(NULL);
+	if (rotate.born > now)
+	{
+		rotate.born = now;	/* the clock went back, count from here */
+	}
+
+	if ((rotate.max_size == 0 || ftell(flog) < rotate.max_size) &&
+	    (rotate.max_age == 0 || now - rotate.born < rotate.max_age))
+	{
+		return;
+	}
+
+	if (rotate.seq == 0)
+	{
+		rotate.seq = log_next_segment();
+	}
+	snprintf(path, sizeof(path), "%s/%s", log_dir, log_name);
+	snprintf(rotated, sizeof(rotated), "%s/ibus-%0*u.%s", log_dir, SEGMENT_DIGITS, rotate.seq, log_text ? "txt" : "cap");
+
+	if (rename(path, rotated) != 0)
+	{
+		rotate.born = now;	/* try again later */
+		return;
+	}
+	rotate.seq++;
+
+	f = fopen(path, "ae");
+	if (f == NULL)
+	{
+		/* keep writing to the renamed one */
+		rotate.born = now;
+		return;
+	}
+
+	fclose(flog);
+	flog = f;
+	rotate.born = now;
+	log_write_session();
+
+	log_compress(rotated);
+	log_expire();
+}
+
+static void *log_writer(void *unused)
+{
+	struct timespec wake;
+
+	while (1)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		wake.tv_nsec += 100000000;
+		if (wake.tv_nsec >= 1000000000)
 		{
-			sprintf(logfile, "%s/ibus.txt", pw->pw_dir);
-			flog = fopen(logfile, "a");
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000;
 		}
 
-		if (flog == NULL)
+		pthread_mutex_lock(&ring.lock);
+		while (!ring.woken && pthread_cond_timedwait(&ring.wake, &ring.lock, &wake) == 0)
+			;
+		ring.woken = FALSE;
+		pthread_mutex_unlock(&ring.lock);
+
+		log_drain();
+
+		if (__atomic_exchange_n(&ring.flush, FALSE, __ATOMIC_ACQ_REL))
+		{
+			fflush(flog);
+		}
+
+		log_rotate();
+
+		if (__atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE))
 		{
-			flog = fopen("/storage/ibus.txt", "a");
+			log_drain();
+			break;
 		}
 	}
+
+	return NULL;
+}
+
+static FILE *log_fopen_dir(const char *dir, const char *name)
+{
+	char logfile[256];
+
+	snprintf(log_dir, sizeof(log_dir), "%s", dir);
+	snprintf(logfile, sizeof(logfile), "%s/%s", log_dir, name);
+	return fopen(logfile, "ae");
+}
+
+static FILE *log_fopen(const char *name)
+{
+	FILE *f;
+
+	log_name = name;
+
+#ifdef __i386__
+	f = log_fopen_dir(".", name);
+#else
+	struct passwd *pw;
+
+	f = NULL;
+	pw = getpwuid(getuid());
+	if (pw)
+	{
+		f = log_fopen_dir(pw->pw_dir, name);
+	}
+
+	if (f == NULL)
+	{
+		f = log_fopen_dir("/storage", name);
+	}
 #endif
+
+	return f;
+}
+
+/*
+ * Every run starts with a session record, so the text timestamps can be worked
+ * out later. The text log gets a "#session <time()>" line instead.
+ */
+
+static void log_write_session(void)
+{
+	static capture_record session;
+	unsigned char bin[CAPTURE_MAX_RECORD];
+	int i;
+
+	if (log_text)
+	{
+		fprintf(flog, "000000.000 #session %lld\n", (long long)time(NULL));
+		return;
+	}
+
+	session.kind = CAPTURE_SESSION;
+	session.usec = (uint64_t)log_start * 1000000;
+	session.data_len = 16;
+	for (i = 0; i < 8; i++)
+	{
+		session.data[i] = ((uint64_t)log_start) >> (i * 8);
+		session.data[i + 8] = ((uint64_t)time(NULL)) >> (i * 8);
+	}
+
+	if (ftell(flog) == 0)
+	{
+		fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, flog);
+	}
+	fwrite(bin, capture_encode(bin, &session), 1, flog);
+}
+
+/*
+ * When the segment at path was started, from the session at its top. pibus is
+ * restarted whenever the car wakes up, so the age can't start with the run.
+ */
+
+static time_t log_segment_born(const char *path)
+{
+	unsigned char bin[CAPTURE_MAGIC_LEN + CAPTURE_MAX_RECORD];
+	capture_record rec;
+	char line[80];
+	long long born;
+	struct stat st;
+	FILE *f;
+	int len;
+
+	if (stat(path, &st) != 0 || st.st_size == 0)
+	{
+		return time(NULL);
+	}
+
+	f = fopen(path, "re");
+	if (f == NULL)
+	{
+		return st.st_mtime;
+	}
+
+	born = 0;
+	if (log_text)
+	{
+		if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "%*u.%*u #session %lld", &born) != 1)
+		{
+			born = 0;
+		}
+	}
+	else
+	{
+		len = fread(bin, 1, sizeof(bin), f);
+		if (len > CAPTURE_MAGIC_LEN && memcmp(bin, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) == 0 &&
+		    capture_decode(bin + CAPTURE_MAGIC_LEN, len - CAPTURE_MAGIC_LEN, &rec) > 0 &&
+		    rec.kind == CAPTURE_SESSION)
+		{
+			born = capture_session_time(&rec);
+		}
+	}
+	fclose(f);
+
+	/* written before there was a session at the top, it's at least this old */
+	return born ? born : st.st_mtime;
+}
+
+int log_open(time_t start, int level, bool text)
+{
+	char path[256];
+	pthread_condattr_t attr;
+
+	log_start = start;
+	log_level = level;
+	log_text = text;
+
+	flog = log_fopen(text ? "ibus.txt" : "ibus.cap");
 	if (flog == NULL)
 	{
 		return 1;
 	}
 
+	snprintf(path, sizeof(path), "%s/%s", log_dir, log_name);
+	rotate.born = log_segment_born(path);
+	log_write_session();
+
+	ring.head = 0;
+	ring.tail = 0;
+	ring.dropped = 0;
+	ring.flush = FALSE;
+	ring.stop = FALSE;
+	ring.woken = FALSE;
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ring.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&ring.thread, NULL, log_writer, NULL) != 0)
+	{
+		fclose(flog);
+		flog = NULL;
+		return 1;
+	}
+	ring.running = TRUE;
+
 	return 0;
 }
 
+/* call before log_open(). size in bytes, age in seconds, 0 = no limit */
+
+void log_set_rotation(long max_size, int max_age, int keep)
+{
+	rotate.max_size = max_size;
+	rotate.max_age = max_age;
+	rotate.keep = keep;
+}
+
+/* the writer thread does the actual flush, this never waits for the SD card */
+
 void log_flush()
 {
-	fflush(flog);
+	if (ring.running)
+	{
+		__atomic_store_n(&ring.flush, TRUE, __ATOMIC_RELEASE);
+		log_wake();
+	}
 }
 
 void log_close()
 {
+	if (!ring.running)
+	{
+		return;
+	}
+
+	__atomic_store_n(&ring.stop, TRUE, __ATOMIC_RELEASE);
+	log_wake();
+	pthread_join(ring.thread, NULL);
+	ring.running = FALSE;
+
 	fflush(flog);
 	fclose(flog);
 	flog = NULL;
+
+	if (rotate.gzip > 0)
+	{
+		waitpid(rotate.gzip, NULL, WNOHANG);
+		rotate.gzip = 0;
+	}
 }
 
 #if 0
@@ -156,14 +639,15 @@ int main()
 	unsigned char buf[] = "\x00\x11\x22\x33\xff";
 	struct timespec ts;
 
-	flog = stdout;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
-	log_start = ts.tv_sec;
+	log_open(ts.tv_sec, 2, TRUE);
 
 	log_msg("idle timeout %d\n", 99);
 	log_msg_with_hex(buf, 5, "ibus_read(): discard %d: ", 7);
 
-	log_ibus(buf, 5, "corrupt");
+	log_ibus(buf, 5, CAPTURE_CORRUPT);
+
+	log_close();
 
 	return 0;
 }
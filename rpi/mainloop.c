@@ -7,16 +7,45 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include "mainloop.h"
 #include "slist.h"
 
 
-static SList *tmr_list;		  /* timer list */
+static timerevent **tmr_heap;	  /* timers, min-heap on next_call */
+static int tmr_heap_len;
+static int tmr_heap_size;
+static timerevent *tmr_hash[64];  /* timers by tag */
+static timerevent *tmr_firing;	  /* timer whose callback is running */
 static int tmr_list_count;
 static SList *se_list;			  /* socket event list */
+static SList *se_dead_list;		  /* removed during dispatch, freed later */
 static int se_list_count;
+static int epfd = -1;			  /* epoll instance */
+static int tfd = -1;			  /* timerfd for the nearest deadline */
+static int tfd_tag = -1;
+static uint64_t tfd_armed;		  /* deadline it's armed to, 0 = none */
+static int efd = -1;			  /* eventfd for mainloop_post() */
 static int done = FALSE;		  /* finished ? */
 
+/* work posted in from other threads */
+struct postRec
+{
+	post_callback func;
+	void *data;
+	struct postRec *next;
+};
+
+static struct postRec *post_head;
+static struct postRec *post_tail;
+static pthread_mutex_t post_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_EVENTS 16
+#define TMR_HASH(tag) ((tag) & 63)
+
 
 uint64_t mainloop_get_millisec(void)
 {
@@ -31,61 +60,226 @@ uint64_t mainloop_get_millisec(void)
 #endif
 }
 
-void mainloop_timeout_remove(int tag)
+uint64_t mainloop_get_microsec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static void tmr_heap_set(int i, timerevent *te)
+{
+	tmr_heap[i] = te;
+	te->heap_index = i;
+}
+
+static void tmr_heap_up(int i)
+{
+	timerevent *te = tmr_heap[i];
+	int parent;
+
+	while (i > 0)
+	{
+		parent = (i - 1) / 2;
+		if (tmr_heap[parent]->next_call <= te->next_call)
+			break;
+		tmr_heap_set(i, tmr_heap[parent]);
+		i = parent;
+	}
+	tmr_heap_set(i, te);
+}
+
+static void tmr_heap_down(int i)
+{
+	timerevent *te = tmr_heap[i];
+	int child;
+
+	while ((child = (i * 2) + 1) < tmr_heap_len)
+	{
+		if (child + 1 < tmr_heap_len && tmr_heap[child + 1]->next_call < tmr_heap[child]->next_call)
+			child++;
+		if (te->next_call <= tmr_heap[child]->next_call)
+			break;
+		tmr_heap_set(i, tmr_heap[child]);
+		i = child;
+	}
+	tmr_heap_set(i, te);
+}
+
+/* call after changing te->next_call */
+
+static void tmr_heap_update(timerevent *te)
+{
+	tmr_heap_up(te->heap_index);
+	tmr_heap_down(te->heap_index);
+}
+
+static void tmr_heap_insert(timerevent *te)
+{
+	if (tmr_heap_len == tmr_heap_size)
+	{
+		tmr_heap_size = tmr_heap_size ? tmr_heap_size * 2 : 16;
+		tmr_heap = realloc(tmr_heap, tmr_heap_size * sizeof(timerevent *));
+	}
+
+	tmr_heap_set(tmr_heap_len++, te);
+	tmr_heap_up(te->heap_index);
+}
+
+static void tmr_heap_delete(timerevent *te)
+{
+	int i = te->heap_index;
+
+	tmr_heap_len--;
+	if (i != tmr_heap_len)
+	{
+		tmr_heap_set(i, tmr_heap[tmr_heap_len]);
+		tmr_heap_update(tmr_heap[i]);
+	}
+}
+
+static timerevent *tmr_lookup(int tag)
 {
 	timerevent *te;
-	SList *list;
 
-	list = tmr_list;
-	while (list)
+	for (te = tmr_hash[TMR_HASH(tag)]; te; te = te->hash_next)
 	{
-		te = (timerevent *) list->data;
 		if (te->tag == tag)
-		{
-			tmr_list = slist_remove(tmr_list, te);
-			free(te);
-			return;
-		}
-		list = list->next;
+			return te;
 	}
+
+	return NULL;
 }
 
-int mainloop_timeout_add(int interval, timer_callback callback, void *userdata)
+void mainloop_timeout_remove(int tag)
+{
+	timerevent **prev;
+	timerevent *te;
+
+	te = tmr_lookup(tag);
+	if (te == NULL)
+	{
+		return;
+	}
+
+	prev = &tmr_hash[TMR_HASH(tag)];
+	while (*prev != te)
+	{
+		prev = &(*prev)->hash_next;
+	}
+	*prev = te->hash_next;
+
+	tmr_heap_delete(te);
+
+	/* removed from inside its own callback, mainloop() frees it */
+	if (te == tmr_firing)
+	{
+		tmr_firing = NULL;
+		return;
+	}
+
+	free(te);
+}
+
+int mainloop_timeout_add_usec(uint64_t interval, timer_policy policy, timer_callback callback, void *userdata)
 {
 	timerevent *te = malloc(sizeof (timerevent));
 
 	tmr_list_count++;	/* this overflows at 2.2Billion, who cares!! */
 
 	te->tag = tmr_list_count;
-	te->interval = interval;
+	te->interval = interval > 0 ? interval : 1;
+	te->policy = policy;
+	te->missed = 0;
 	te->callback = callback;
 	te->userdata = userdata;
 
-	te->next_call = mainloop_get_millisec() + te->interval;
+	te->next_call = mainloop_get_microsec() + te->interval;
 
-	tmr_list = slist_prepend(tmr_list, te);
+	te->hash_next = tmr_hash[TMR_HASH(te->tag)];
+	tmr_hash[TMR_HASH(te->tag)] = te;
+	tmr_heap_insert(te);
 
 	return te->tag;
 }
 
+int mainloop_timeout_add_policy(int interval, timer_policy policy, timer_callback callback, void *userdata)
+{
+	return mainloop_timeout_add_usec((uint64_t)interval * 1000, policy, callback, userdata);
+}
+
+int mainloop_timeout_add(int interval, timer_callback callback, void *userdata)
+{
+	return mainloop_timeout_add_policy(interval, TIMER_SKIP, callback, userdata);
+}
+
+int mainloop_timeout_missed(int tag)
+{
+	timerevent *te;
+
+	te = tmr_lookup(tag);
+	if (te == NULL)
+	{
+		return 0;
+	}
+
+	return te->missed;
+}
+
+/* move a timer to its next deadline, measured from the last one so it doesn't drift */
+
+static void tmr_reschedule(timerevent *te, uint64_t now)
+{
+	uint64_t late;
+
+	te->next_call += te->interval;
+	if (te->next_call > now)
+	{
+		return;
+	}
+
+	switch (te->policy)
+	{
+		case TIMER_SKIP:
+			late = ((now - te->next_call) / te->interval) + 1;
+			te->next_call += late * te->interval;
+			te->missed += late;
+			break;
+
+		case TIMER_COALESCE:
+			late = ((now - te->next_call) / te->interval) + 1;
+			te->next_call = now + te->interval;
+			te->missed += late;
+			break;
+	}
+}
+
 /*void mainloop_timeout_override_nextcall(int tag, uint64_t next_call)
 {
 	timerevent *te;
-	SList *list;
 
-	list = tmr_list;
-	while (list)
+	te = tmr_lookup(tag);
+	if (te)
 	{
-		te = (timerevent *) list->data;
-		if (te->tag == tag)
-		{
-			te->next_call = next_call;
-			return;
-		}
-		list = list->next;
+		te->next_call = next_call;
+		tmr_heap_update(te);
 	}
 }*/
 
+static uint32_t mainloop_epoll_events(socketevent *se)
+{
+	uint32_t events = 0;
+
+	if (se->rread)
+		events |= EPOLLIN;
+	if (se->wwrite)
+		events |= EPOLLOUT;
+	if (se->eexcept)
+		events |= EPOLLPRI;
+
+	return events;
+}
+
 void mainloop_input_remove(int tag)
 {
 	socketevent *se;
@@ -97,8 +291,12 @@ void mainloop_input_remove(int tag)
 		se = (socketevent *) list->data;
 		if (se->tag == tag)
 		{
+			epoll_ctl(epfd, EPOLL_CTL_DEL, se->sok, NULL);
 			se_list = slist_remove(se_list, se);
-			free(se);
+
+			/* there may still be a pending event pointing at it */
+			se->callback = NULL;
+			se_dead_list = slist_prepend(se_dead_list, se);
 			return;
 		}
 		list = list->next;
@@ -107,152 +305,273 @@ void mainloop_input_remove(int tag)
 
 int mainloop_input_add(int sok, int flags, socket_callback func, void *data)
 {
+	struct epoll_event ev;
 	socketevent *se = malloc(sizeof(socketevent));
 
 	se_list_count++;	/* this overflows at 2.2Billion, who cares!! */
 
 	se->tag = se_list_count;
 	se->sok = sok;
-	se->rread = flags & FIA_READ;
-	se->wwrite = flags & FIA_WRITE;
-	se->eexcept = flags & FIA_EX;
-	se->checked = 0;
+	se->rread = (flags & FIA_READ) ? 1 : 0;
+	se->wwrite = (flags & FIA_WRITE) ? 1 : 0;
+	se->eexcept = (flags & FIA_EX) ? 1 : 0;
 	se->callback = func;
 	se->userdata = data;
 	se_list = slist_prepend(se_list, se);
 
+	memset(&ev, 0, sizeof(ev));
+	ev.events = mainloop_epoll_events(se);
+	ev.data.ptr = se;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sok, &ev);
+
 	return se->tag;
 }
 
+/* change what an input is waiting for, e.g. FIA_WRITE only while there's something to send */
+
+void mainloop_input_set_flags(int tag, int flags)
+{
+	struct epoll_event ev;
+	socketevent *se;
+	SList *list;
+
+	list = se_list;
+	while (list)
+	{
+		se = (socketevent *) list->data;
+		if (se->tag == tag)
+		{
+			se->rread = (flags & FIA_READ) ? 1 : 0;
+			se->wwrite = (flags & FIA_WRITE) ? 1 : 0;
+			se->eexcept = (flags & FIA_EX) ? 1 : 0;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = mainloop_epoll_events(se);
+			ev.data.ptr = se;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, se->sok, &ev);
+			return;
+		}
+		list = list->next;
+	}
+}
+
+static void mainloop_timerfd_read(int condition, void *unused)
+{
+	uint64_t expirations;
+
+	read(tfd, &expirations, sizeof(expirations));
+
+	/* a one-shot timerfd disarms itself */
+	tfd_armed = 0;
+}
+
+/* timers are accurate to the microsecond with a timerfd, to the millisecond without */
+
+void mainloop_use_timerfd(bool enable)
+{
+	if (enable && tfd == -1)
+	{
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (tfd != -1)
+		{
+			tfd_armed = 0;
+			tfd_tag = mainloop_input_add(tfd, FIA_READ, mainloop_timerfd_read, NULL);
+		}
+	}
+	else if (!enable && tfd != -1)
+	{
+		mainloop_input_remove(tfd_tag);
+		close(tfd);
+		tfd = -1;
+		tfd_tag = -1;
+	}
+}
+
+static void mainloop_timerfd_arm(uint64_t deadline)
+{
+	struct itimerspec its;
+
+	if (deadline == tfd_armed)
+	{
+		return;
+	}
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000000;
+	its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+	tfd_armed = deadline;
+}
+
+/* this one is thread-safe, func is called from the mainloop thread */
+
+int mainloop_post(post_callback func, void *data)
+{
+	struct postRec *post;
+	uint64_t one = 1;
+
+	post = malloc(sizeof(struct postRec));
+	if (post == NULL)
+	{
+		return -1;
+	}
+
+	post->func = func;
+	post->data = data;
+	post->next = NULL;
+
+	pthread_mutex_lock(&post_mutex);
+	if (post_tail)
+		post_tail->next = post;
+	else
+		post_head = post;
+	post_tail = post;
+	pthread_mutex_unlock(&post_mutex);
+
+	write(efd, &one, sizeof(one));
+
+	return 0;
+}
+
+static void mainloop_post_read(int condition, void *unused)
+{
+	struct postRec *post, *next;
+	uint64_t count;
+
+	read(efd, &count, sizeof(count));
+
+	pthread_mutex_lock(&post_mutex);
+	post = post_head;
+	post_head = NULL;
+	post_tail = NULL;
+	pthread_mutex_unlock(&post_mutex);
+
+	while (post)
+	{
+		next = post->next;
+		post->func(post->data);
+		free(post);
+		post = next;
+	}
+}
+
 void mainloop_init(void)
 {
-	tmr_list = NULL;
+	tmr_heap = NULL;
+	tmr_heap_len = 0;
+	tmr_heap_size = 0;
+	memset(tmr_hash, 0, sizeof(tmr_hash));
+	tmr_firing = NULL;
 	se_list = NULL;
+	se_dead_list = NULL;
 
 	tmr_list_count = 0;
 	se_list_count = 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd != -1)
+	{
+		mainloop_input_add(efd, FIA_READ, mainloop_post_read, NULL);
+	}
+
+	mainloop_use_timerfd(TRUE);
+}
+
+static void mainloop_dispatch(socketevent *se, uint32_t events)
+{
+	/* removed by an earlier callback in this batch */
+	if (se->callback == NULL)
+	{
+		return;
+	}
+
+	/* errors and hangups are reported as readable, just like select() */
+	if (se->rread && (events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+	{
+		se->callback(FIA_READ, se->userdata);
+	}
+	else if (se->wwrite && (events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+	{
+		se->callback(FIA_WRITE, se->userdata);
+	}
+	else if (se->eexcept && (events & (EPOLLPRI|EPOLLERR|EPOLLHUP)))
+	{
+		se->callback(FIA_EX, se->userdata);
+	}
 }
 
 void mainloop(void)
 {
-	struct timeval timeout;
-	socketevent *se;
+	struct epoll_event events[MAX_EVENTS];
 	timerevent *te;
-	int nfds;
-	fd_set rd, wd, ex;
-	SList *list;
-	uint64_t shortest, delay;
-	uint64_t ms;
+	int timeout;
+	int i, n;
+	uint64_t now;
 
 	while (!done)
 	{
-		nfds = 0;
-		FD_ZERO(&rd);
-		FD_ZERO(&wd);
-		FD_ZERO(&ex);
-
-		list = se_list;
-		while (list)
+		/* the shortest timeout event is at the top of the heap */
+		now = mainloop_get_microsec();
+		if (tmr_heap_len == 0)
 		{
-			se = (socketevent *) list->data;
-			if (se->rread)
-				FD_SET(se->sok, &rd);
-			if (se->wwrite)
-				FD_SET(se->sok, &wd);
-			if (se->eexcept)
-				FD_SET(se->sok, &ex);
-			if (se->sok > nfds)
-				nfds = se->sok;
-			list = list->next;
+			timeout = -1;
 		}
-
-		/* find the shortest timeout event */
-		shortest = 0;
-		list = tmr_list;
-		while (list)
+		else if (tmr_heap[0]->next_call <= now)
 		{
-			te = (timerevent *) list->data;
-			if (te->next_call < shortest || shortest == 0)
-				shortest = te->next_call;
-			list = list->next;
+			timeout = 0;
 		}
-
-		ms = mainloop_get_millisec();
-		if (shortest > ms)
+		else if (tfd != -1)
 		{
-			delay = shortest - ms;
-			timeout.tv_sec = delay / 1000;
-			timeout.tv_usec = (delay % 1000) * 1000;
+			mainloop_timerfd_arm(tmr_heap[0]->next_call);
+			timeout = -1;
 		}
 		else
 		{
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 0;
+			/* round up, waking early would just spin */
+			timeout = (tmr_heap[0]->next_call - now + 999) / 1000;
 		}
 
-		select(nfds + 1, &rd, &wd, &ex, &timeout);
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
 
-		/* set all checked flags to false */
-		list = se_list;
-		while (list)
+		/* only the ready sockets get looked at */
+		for (i = 0; i < n; i++)
 		{
-			se = (socketevent *) list->data;
-			se->checked = 0;
-			list = list->next;
+			mainloop_dispatch(events[i].data.ptr, events[i].events);
 		}
 
-		/* check all the socket callbacks */
-		list = se_list;
-		while (list)
+		while (se_dead_list)
 		{
-			se = (socketevent *) list->data;
-			se->checked = 1;
-			if (se->rread && FD_ISSET(se->sok, &rd))
-			{
-				se->callback(FIA_READ, se->userdata);
-			}
-			else if (se->wwrite && FD_ISSET(se->sok, &wd))
-			{
-				se->callback(FIA_WRITE, se->userdata);
-			}
-			else if (se->eexcept && FD_ISSET(se->sok, &ex))
-			{
-				se->callback(FIA_EX, se->userdata);
-			}
-			list = se_list;
-			if (list)
-			{
-				se = (socketevent *) list->data;
-				while (se->checked)
-				{
-					list = list->next;
-					if (!list)
-						break;
-					se = (socketevent *) list->data;
-				}
-			}
+			free(se_dead_list->data);
+			se_dead_list = slist_remove(se_dead_list, se_dead_list->data);
 		}
 
-		/* now check our list of timeout events, some might need to be called! */
-		ms = mainloop_get_millisec();
-do_timers:
-		list = tmr_list;
-		while (list)
+		/* now check our timeout events, some might need to be called! */
+		now = mainloop_get_microsec();
+		while (tmr_heap_len && now >= tmr_heap[0]->next_call)
 		{
-			te = (timerevent *) list->data;
-			list = list->next;
-			if (ms >= te->next_call)
+			te = tmr_heap[0];
+			tmr_firing = te;
+
+			/* if the callback returns 0, it must be removed */
+			if (te->callback(te->userdata) == 0)
 			{
-				/* if the callback returns 0, it must be removed */
-				if (te->callback(te->userdata) == 0)
-				{
-					mainloop_timeout_remove(te->tag);
-					goto do_timers;
-				}
-				te->next_call = ms + te->interval;
+				mainloop_timeout_remove(te->tag);
+			}
+
+			if (tmr_firing == NULL)
+			{
+				/* it was removed */
+				free(te);
+				continue;
 			}
-		}
 
+			tmr_firing = NULL;
+			tmr_reschedule(te, now);
+			tmr_heap_update(te);
+		}
 	}
 }
 
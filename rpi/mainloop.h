@@ -9,8 +9,17 @@
 
 typedef int bool;
 
+/* what a periodic timer does when it falls behind */
+typedef enum
+{
+	TIMER_SKIP = 0,		/* drop the missed periods, stay on the same grid */
+	TIMER_COALESCE = 1	/* drop the missed periods, restart the grid from now */
+}
+timer_policy;
+
 typedef void (*socket_callback) (int condition, void *user_data);
 typedef int (*timer_callback) (void *user_data);
+typedef void (*post_callback) (void *user_data);
 
 struct socketeventRec
 {
@@ -18,10 +27,9 @@ struct socketeventRec
 	void *userdata;
 	int sok;
 	int tag;
-	int rread:1;
-	int wwrite:1;
-	int eexcept:1;
-	int checked:1;
+	unsigned int rread:1;
+	unsigned int wwrite:1;
+	unsigned int eexcept:1;
 };
 
 typedef struct socketeventRec socketevent;
@@ -31,22 +39,33 @@ struct timerRec
 {
 	timer_callback callback;
 	void *userdata;
-	int interval;
+	uint64_t interval;	/* microseconds */
 	int tag;
-	uint64_t next_call;	/* milliseconds */
+	timer_policy policy;
+	int missed;		/* periods that were late */
+	uint64_t next_call;	/* microseconds */
+	int heap_index;		/* position in the timer heap */
+	struct timerRec *hash_next;	/* tag lookup chain */
 };
 
 typedef struct timerRec timerevent;
 
 
 void mainloop_init(void);
+void mainloop_use_timerfd(bool enable);
 uint64_t mainloop_get_millisec(void);
+uint64_t mainloop_get_microsec(void);
 void mainloop(void);
+int mainloop_post(post_callback func, void *data);
 
 void mainloop_timeout_remove(int tag);
 int mainloop_timeout_add(int interval, timer_callback callback, void *userdata);
+int mainloop_timeout_add_policy(int interval, timer_policy policy, timer_callback callback, void *userdata);
+int mainloop_timeout_add_usec(uint64_t interval, timer_policy policy, timer_callback callback, void *userdata);
+int mainloop_timeout_missed(int tag);
 void mainloop_timeout_override_nextcall(int tag, uint64_t next_call);
 
 void mainloop_input_remove(int tag);
 int mainloop_input_add(int sok, int flags, socket_callback func, void *data);
+void mainloop_input_set_flags(int tag, int flags);
 
@@ -0,0 +1,105 @@
+/*
+ * pibus-annotate: turns an ibus.cap capture into the ibus.txt text format.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mainloop.h"
+#include "capture.h"
+
+
+
+int main(int argc, char **argv)
+{
+	unsigned char buf[65536];
+	char text[CAPTURE_MAX_TEXT];
+	capture_record rec;
+	uint64_t start = 0;
+	int level = 2;
+	int len = 0;
+	int pos = 0;
+	int opt;
+	int r;
+	FILE *in = stdin;
+
+	while ((opt = getopt(argc, argv, "l:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l':
+				level = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				fprintf(stderr,
+					"Usage: %s [-l <level>] [ibus.cap]\n"
+					"\n"
+					"Flags:\n"
+					"\t-l <level>   Annotation level (0=none 1=basic 2=default 3=verbose)\n"
+					"\n",
+					argv[0]);
+				return -1;
+		}
+	}
+
+	if (argc > optind)
+	{
+		in = fopen(argv[optind], "rb");
+		if (in == NULL)
+		{
+			perror(argv[optind]);
+			return -2;
+		}
+	}
+
+	if (fread(buf, CAPTURE_MAGIC_LEN, 1, in) != 1 || memcmp(buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+	{
+		fprintf(stderr, "Not a pibus capture file\n");
+		return -3;
+	}
+
+	while (1)
+	{
+		r = capture_decode(buf + pos, len - pos, &rec);
+		if (r < 0)
+		{
+			fprintf(stderr, "Corrupt record, stopping\n");
+			return -4;
+		}
+
+		if (r == 0)
+		{
+			/* need more */
+			memmove(buf, buf + pos, len - pos);
+			len -= pos;
+			pos = 0;
+
+			r = fread(buf + len, 1, sizeof(buf) - len, in);
+			if (r <= 0)
+			{
+				break;
+			}
+			len += r;
+			continue;
+		}
+		pos += r;
+
+		if (rec.kind == CAPTURE_SESSION)
+		{
+			start = capture_session_start(&rec);
+		}
+
+		fwrite(text, capture_format_text(text, &rec, start, level), 1, stdout);
+	}
+
+	if (len != pos)
+	{
+		fprintf(stderr, "Truncated record at the end\n");
+	}
+
+	return 0;
+}
@@ -14,6 +14,9 @@
 #include "mainloop.h"
 #include "ibus.h"
 #include "gpio.h"
+#include "log.h"
+#include "server.h"
+#include "ibus-send.h"
 
 
 
@@ -36,11 +39,20 @@ int main(int argc, char **argv)
 	bool rotary_opposite = FALSE;
 	bool z4_keymap = FALSE;
 	int log_level = 2;
+	bool text_log = FALSE;
 	int coolant_warning = 300;
+	long log_size = 16;
+	int log_age = 24;
+	int log_keep = 8;
+	const char *unix_path = "/tmp/pibus.sock";
+	int backlog = 16;
+	int tx_gap = 3;
+	int tx_burst = 8;
+	int tx_queue = 320;
 
 	mainloop_init();
 
-	while ((opt = getopt(argc, argv, "a:c:g:l:p:s:t:w:v:z:bhmnorV")) != -1)
+	while ((opt = getopt(argc, argv, "a:c:g:k:l:p:q:s:t:u:w:v:z:A:B:G:N:S:bhmnorTVx")) != -1)
 	{
 		switch (opt)
 		{
@@ -57,6 +69,9 @@ int main(int argc, char **argv)
 				gpio_number = atoi(optarg);
 				gpio_changed = TRUE;
 				break;
+			case 'k':
+				log_keep = atoi(optarg);
+				break;
 			case 'l':
 				log_level = atoi(optarg);
 				break;
@@ -81,12 +96,39 @@ int main(int argc, char **argv)
 			case 't':
 				idle_timeout = atoi(optarg);
 				break;
+			case 'S':
+				log_size = atol(optarg);
+				break;
+			case 'A':
+				log_age = atoi(optarg);
+				break;
+			case 'G':
+				tx_gap = atoi(optarg);
+				break;
+			case 'N':
+				tx_burst = atoi(optarg);
+				break;
+			case 'q':
+				tx_queue = atoi(optarg);
+				break;
+			case 'T':
+				mainloop_use_timerfd(FALSE);
+				break;
+			case 'u':
+				unix_path = optarg;
+				break;
+			case 'B':
+				backlog = atoi(optarg);
+				break;
 			case 'w':
 				coolant_warning = atoi(optarg);
 				break;
 			case 'v':
 				hw_version = atoi(optarg);
 				break;
+			case 'x':
+				text_log = TRUE;
+				break;
 			case 'V':
 				printf("%s ["__DATE__"]\n", argv[0]);
 				exit(0);
@@ -106,17 +148,27 @@ int main(int argc, char **argv)
 					"\t-b           Car has bluetooth, don't use Phone and Speak buttons\n"
 					"\t-c <time>    Force CDC-info replies every <time> seconds\n"
 					"\t-g <number>  GPIO number to use for IBUS line monitor (0 = Use TH3122)\n"
+					"\t-k <count>   Number of rotated logs to keep (default 8)\n"
+					"\t-q <count>   Most frames queued for transmit, clients get 48 less (default 320)\n"
 					"\t-l <level>   Logging level (0=none 1=basic 2=default 3=verbose)\n"
 					"\t-m           Do not do CDC reset announcements\n"
 					"\t-n           Handle Next/Prev buttons directly (some radios need it)\n"
 					"\t-o           Make rotary dial direction opposite\n"
-					"\t-p           TCP server port number (default: 55537)\n"
+					"\t-p           TCP server port number (default: 55537, 0 = none)\n"
 					"\t-r           Do not switch to camera in reverse gear\n"
 					"\t-s <string>  Send extra string to IBUS at startup\n"
 					"\t-t <seconds> Set the idle timeout in seconds (V4 boards only, default 300)\n"
+					"\t-S <MB>      Rotate the log when it reaches <MB> megabytes (default 16, 0 = never)\n"
+					"\t-A <hours>   Rotate the log every <hours> hours (default 24, 0 = never)\n"
+					"\t-u <path>    Unix SOCK_SEQPACKET server socket (default: /tmp/pibus.sock, \"\" = none)\n"
+					"\t-B <count>   Server listen backlog (default 16)\n"
+					"\t-G <ms>      Gap between our own frames in a burst (default 3)\n"
+					"\t-N <count>   Frames sent in a burst before the first echoes back (default 8)\n"
+					"\t-T           Use millisecond timers instead of timerfd\n"
 					"\t-w <temp>    Generate coolant warning above <temp> degrees\n"
 					"\t-v <number>  Set PiBUS hardware version\n"
 					"\t-z4          Use alternative Z4 keymap\n"
+					"\t-x           Write a text log (ibus.txt) instead of ibus.cap\n"
 					"\t-V           Show version information\n"
 					"\n",
 					argv[0]);
@@ -140,7 +192,11 @@ int main(int argc, char **argv)
 		return -4;
 	}
 
-	if (ibus_init(port, startup, bluetooth, camera, cdc_announce, cdcinterval, gpio_number, idle_timeout, hw_version, input, handle_nextprev, rotary_opposite, z4_keymap, server_port, log_level, coolant_warning) != 0)
+	log_set_rotation(log_size * 1024 * 1024, log_age * 3600, log_keep);
+	server_config(unix_path, backlog);
+	ibus_tx_config(tx_gap, tx_burst, tx_queue);
+
+	if (ibus_init(port, startup, bluetooth, camera, cdc_announce, cdcinterval, gpio_number, idle_timeout, hw_version, input, handle_nextprev, rotary_opposite, z4_keymap, server_port, log_level, text_log, coolant_warning) != 0)
 	{
 		return -2;
 	}
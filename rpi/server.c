@@ -1,3 +1,4 @@
+#define _GNU_SOURCE		/* accept4() */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,115 +7,922 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #include "mainloop.h"
 #include "slist.h"
 #include "ibus.h"
+#include "server.h"
+#include "ibus-send.h"
+#include "shmring.h"
 
 #define set_blocking(sok) fcntl(sok, F_SETFL, 0)
 #define set_nonblocking(sok) fcntl(sok, F_SETFL, O_NONBLOCK)
 
+#define CMD_SIZ 256
+#define IN_SIZ 2048	/* more than BIN_HEADER + BIN_MAX_PAYLOAD */
+#define BATCH_SIZ 1024
+#define READS_PER_WAKEUP 4	/* give the ibus a go in between */
+#define OUT_SIZ (BIN_HEADER + 260)	/* a text line or a binary frame */
+#define OUT_SLOTS 64	/* power of 2 */
+#define OUT_IOV 16
+
+/* what to do when a client can't keep up and its queue is full */
+typedef enum
+{
+	POLICY_DROP,		/* throw away the oldest line */
+	POLICY_DISCONNECT,	/* kick it off */
+	POLICY_COALESCE		/* stop queueing until it catches up, then say "dropped N" */
+}
+overflow_policy;
+
+typedef struct
+{
+	int len;
+	char data[OUT_SIZ];
+}
+out_slot;
+
+/* matched against the frame's source, destination and first data byte */
+#define MAX_SUBS 16
+#define SUB_HAS_CMD (1 << 24)
+
+typedef struct
+{
+	uint32_t value;
+	uint32_t mask;
+}
+sub_filter;
+
 typedef struct _connection
 {
 	int socket;
 	int tag;
-	int pos;
-#define CMD_SIZ 256
+	unsigned int id;	/* for server_notify_done() */
+	bool packet;		/* SOCK_SEQPACKET, one message per packet */
+	bool binary;
+	char in[IN_SIZ];	/* read but not handled yet */
+	int in_len;
+	bool overlong;		/* discarding a line that's too long */
 	char cmd[CMD_SIZ];
+	bool batching;		/* collecting "txbatch" frames until "end" */
+	bool batch_failed;	/* a line was bad, the rest goes nowhere */
+	bool batch_sync;
+	int batch_tag;
+	uint32_t batch_id;
+	int batch_len;
+	unsigned char batch[BATCH_SIZ];
+	out_slot out[OUT_SLOTS];
+	unsigned int out_head;	/* next free slot */
+	unsigned int out_tail;	/* oldest unsent slot */
+	int out_off;		/* bytes of the tail slot already sent */
+	bool writing;		/* waiting for FIA_WRITE */
+	overflow_policy policy;
+	unsigned int dropped;
+	unsigned int coalesced;	/* dropped since the last "dropped" line */
+	sub_filter subs[MAX_SUBS];
+	int sub_count;		/* 0 = wants everything */
 }
 connection;
 
+static const char *policy_names[] = {"drop", "disconnect", "coalesce"};
+
 
 static SList *connect_list = NULL;
 static int listen_tag = -1;
 static int server_socket = -1;
+static int unix_socket = -1;
+static unsigned int last_id;
+static const char *unix_path = "/tmp/pibus.sock";
+static int backlog = 16;
+
 
+static void server_free(void *conn)
+{
+	free(conn);
+}
+
+static void server_disconnect(connection *conn)
+{
+	if (conn->socket == -1)
+	{
+		return;
+	}
+
+	connect_list = slist_remove(connect_list, conn);
+	mainloop_input_remove(conn->tag);
+	close(conn->socket);
+	conn->socket = -1;
+
+	/* our callers may still be looking at it */
+	mainloop_post(server_free, conn);
+}
 
-static void server_send_data(const char *msg, int length)
+static void server_queue_slot(connection *conn, const char *msg, int length)
+{
+	out_slot *slot;
+
+	if (length > OUT_SIZ)
+	{
+		length = OUT_SIZ;
+	}
+
+	slot = &conn->out[conn->out_head & (OUT_SLOTS - 1)];
+	memcpy(slot->data, msg, length);
+	slot->len = length;
+	conn->out_head++;
+}
+
+static int server_bin_header(char *out, bin_type type, int flags, int length)
+{
+	uint64_t usec;
+	int i;
+
+	usec = mainloop_get_microsec();
+
+	out[0] = length;
+	out[1] = length >> 8;
+	out[2] = type;
+	out[3] = flags;
+	for (i = 0; i < 8; i++)
+	{
+		out[4 + i] = usec >> (i * 8);
+	}
+
+	return BIN_HEADER;
+}
+
+static int server_bin_frame(char *out, bin_type type, const void *payload, int length)
+{
+	if (length > OUT_SIZ - BIN_HEADER)
+	{
+		length = OUT_SIZ - BIN_HEADER;
+	}
+
+	server_bin_header(out, type, 0, length);
+	memcpy(out + BIN_HEADER, payload, length);
+
+	return BIN_HEADER + length;
+}
+
+/* a text protocol line, binary clients get it wrapped in a BIN_TEXT frame */
+
+static int server_format_text(connection *conn, char *out, const char *text, int length)
+{
+	if (conn->binary)
+	{
+		return server_bin_frame(out, BIN_TEXT, text, length);
+	}
+
+	memcpy(out, text, length);
+	return length;
+}
+
+/* write out as much of the queue as the socket takes, ask for FIA_WRITE if anything is left */
+
+static void server_flush(connection *conn)
+{
+	struct iovec iov[OUT_IOV];
+	struct msghdr mh;
+	out_slot *slot;
+	char note[32];
+	char buf[OUT_SIZ];
+	unsigned int i;
+	int n;
+	int r;
+
+	while (1)
+	{
+		if (conn->out_tail == conn->out_head)
+		{
+			if (conn->coalesced == 0)
+			{
+				break;
+			}
+
+			/* caught up, tell it what it missed */
+			r = snprintf(note, sizeof(note), "dropped %u\n", conn->coalesced);
+			conn->coalesced = 0;
+			server_queue_slot(conn, buf, server_format_text(conn, buf, note, r));
+		}
+
+		n = 0;
+		/* a packet socket would glue them together */
+		for (i = conn->out_tail; i != conn->out_head && n < (conn->packet ? 1 : OUT_IOV); i++, n++)
+		{
+			slot = &conn->out[i & (OUT_SLOTS - 1)];
+			iov[n].iov_base = slot->data;
+			iov[n].iov_len = slot->len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + conn->out_off;
+		iov[0].iov_len -= conn->out_off;
+
+		/* sendmsg() is writev() that won't raise SIGPIPE */
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		r = sendmsg(conn->socket, &mh, MSG_NOSIGNAL);
+		if (r == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				server_disconnect(conn);
+				return;
+			}
+			break;
+		}
+
+		while (r > 0)
+		{
+			slot = &conn->out[conn->out_tail & (OUT_SLOTS - 1)];
+			if (r >= slot->len - conn->out_off)
+			{
+				r -= slot->len - conn->out_off;
+				conn->out_off = 0;
+				conn->out_tail++;
+			}
+			else
+			{
+				conn->out_off += r;
+				r = 0;
+			}
+		}
+	}
+
+	if (conn->writing != (conn->out_tail != conn->out_head))
+	{
+		conn->writing = !conn->writing;
+		mainloop_input_set_flags(conn->tag, FIA_READ|FIA_EX|(conn->writing ? FIA_WRITE : 0));
+	}
+}
+
+static void server_queue(connection *conn, const char *msg, int length)
+{
+	out_slot *slot;
+
+	if (conn->socket == -1)
+	{
+		return;
+	}
+
+	if (conn->coalesced)
+	{
+		conn->dropped++;
+		conn->coalesced++;
+		return;
+	}
+
+	if (conn->out_head - conn->out_tail == OUT_SLOTS)
+	{
+		switch (conn->policy)
+		{
+			case POLICY_DROP:
+				/* the tail may be half sent, keep it and drop the one after */
+				conn->dropped++;
+				if (conn->out_off)
+				{
+					slot = &conn->out[(conn->out_tail + 1) & (OUT_SLOTS - 1)];
+					memcpy(slot, &conn->out[conn->out_tail & (OUT_SLOTS - 1)], sizeof(out_slot));
+				}
+				conn->out_tail++;
+				break;
+			case POLICY_DISCONNECT:
+				server_disconnect(conn);
+				return;
+			case POLICY_COALESCE:
+				conn->dropped++;
+				conn->coalesced++;
+				return;
+		}
+	}
+
+	server_queue_slot(conn, msg, length);
+
+	/* nothing waiting in front of it, try sending right away */
+	if (!conn->writing)
+	{
+		server_flush(conn);
+	}
+}
+
+static void server_reply(connection *conn, const char *msg, int length)
+{
+	char buf[OUT_SIZ];
+
+	server_queue(conn, buf, server_format_text(conn, buf, msg, length));
+}
+
+static void server_format_hex(char *buf, int *pos, const char *prefix, const unsigned char *msg, int length)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+	int prefix_len;
+
+	prefix_len = strlen(prefix);
+	memcpy(buf, prefix, prefix_len);
+	*pos = prefix_len;
+
+	for (i = 0; (i < length) && (i < (CMD_SIZ - (prefix_len + 1)) / 2); i++)
+	{
+		buf[(*pos)++] = hex[msg[i] >> 4];
+		buf[(*pos)++] = hex[msg[i] & 15];
+	}
+
+	buf[(*pos)++] = '\n';
+}
+
+static uint32_t server_frame_key(const unsigned char *msg, int length)
+{
+	uint32_t key;
+
+	key = msg[0] << 16;
+	if (length > 2)
+		key |= msg[2] << 8;
+	if (length > 3)
+		key |= msg[3] | SUB_HAS_CMD;
+
+	return key;
+}
+
+static bool server_wants(connection *conn, uint32_t key)
+{
+	int i;
+
+	if (conn->sub_count == 0)
+	{
+		return TRUE;
+	}
+
+	for (i = 0; i < conn->sub_count; i++)
+	{
+		if ((key & conn->subs[i].mask) == conn->subs[i].value)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* send an ibus frame to the clients subscribed to it, each format is only built if somebody wants it */
+
+static void server_send_frame(const char *prefix, bin_type type, const unsigned char *msg, int length)
 {
 	SList *list;
 	connection *conn;
+	char buf[CMD_SIZ];
+	char bin[OUT_SIZ];
+	uint32_t key;
+	int pos = 0;
+	int bin_len = 0;
+
+	key = server_frame_key(msg, length);
 
-	/* send it to every connected client */
 	list = connect_list;
 	while (list)
 	{
 		conn = list->data;
-		write(conn->socket, msg, length);
-		list = list->next;
+		list = list->next;	/* server_queue() might disconnect it */
+
+		if (!server_wants(conn, key))
+		{
+			continue;
+		}
+
+		if (conn->binary)
+		{
+			if (bin_len == 0)
+			{
+				bin_len = server_bin_frame(bin, type, msg, length);
+			}
+			server_queue(conn, bin, bin_len);
+		}
+		else
+		{
+			if (pos == 0)
+			{
+				server_format_hex(buf, &pos, prefix, msg, length);
+			}
+			server_queue(conn, buf, pos);
+		}
+	}
+}
+
+/* "<src> <dst> [<cmd>]", each one a hex byte or * */
+
+static bool server_parse_filter(char *args, sub_filter *f)
+{
+	char *tok;
+	char *save;
+	char *end;
+	long v;
+	int field;
+
+	f->value = 0;
+	f->mask = 0;
+	field = 0;
+
+	for (tok = strtok_r(args, " ", &save); tok; tok = strtok_r(NULL, " ", &save), field++)
+	{
+		if (field > 2)
+		{
+			return FALSE;
+		}
+
+		if (strcmp(tok, "*") == 0)
+		{
+			continue;
+		}
+
+		v = strtol(tok, &end, 16);
+		if (end == tok || *end || v < 0 || v > 0xff)
+		{
+			return FALSE;
+		}
+
+		f->value |= v << (16 - (field * 8));
+		f->mask |= 0xff << (16 - (field * 8));
+		if (field == 2)
+		{
+			f->value |= SUB_HAS_CMD;
+			f->mask |= SUB_HAS_CMD;
+		}
 	}
+
+	return field >= 2;
 }
 
-static void server_send_hex(const char *prefix, const unsigned char *msg, int length)
+static int server_find_filter(connection *conn, sub_filter *f)
 {
 	int i;
-	int prefix_len;
-	int pos;
+
+	for (i = 0; i < conn->sub_count; i++)
+	{
+		if (conn->subs[i].value == f->value && conn->subs[i].mask == f->mask)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* reply to just this client */
+
+static void server_reply_hex(connection *conn, const char *prefix, const unsigned char *msg, int length)
+{
 	char buf[CMD_SIZ];
+	int pos;
 
-	prefix_len = strlen(prefix);
-	strcpy(buf, prefix);
-	pos = prefix_len;
+	server_format_hex(buf, &pos, prefix, msg, length);
+	server_reply(conn, buf, pos);
+}
+
+static int server_hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* returns the number of bytes, or -1 if it isn't all hex or doesn't fit */
+
+static int server_parse_hex(const char *hex, unsigned char *out, int max)
+{
+	int hi, lo;
+	int n = 0;
+
+	while (hex[0])
+	{
+		hi = server_hex_digit(hex[0]);
+		lo = server_hex_digit(hex[1]);
+		if (hi == -1 || lo == -1 || n == max)
+		{
+			return -1;
+		}
+		out[n++] = (hi << 4) | lo;
+		hex += 2;
+	}
+
+	return n;
+}
 
-	for (i = 0; (i < length) && (i < (sizeof(buf) - (prefix_len + 1)) / 2); i++)
+static uint64_t server_cookie(connection *conn, uint32_t request)
+{
+	return ((uint64_t)conn->id << 32) | request;
+}
+
+/*
+ * A client's tag 1-255 made unique to its connection, so one client can't
+ * replace another's frames. 0 = no tag, in both protocols.
+ */
+
+static int server_client_tag(connection *conn, int tag)
+{
+	if (tag == 0)
+	{
+		return 0;
+	}
+	return TAG_CLIENT + ((conn->id & 0x3fffff) << 8) + tag;
+}
+
+/* "txbatch [sync] [tag=<n>] [id=<n>]", tag 1-255 */
+
+static bool server_begin_batch(connection *conn, char *args)
+{
+	char *tok;
+	char *save;
+
+	conn->batch_failed = FALSE;
+	conn->batch_sync = FALSE;
+	conn->batch_tag = 0;
+	conn->batch_id = 0;
+	conn->batch_len = 0;
+
+	for (tok = strtok_r(args, " ", &save); tok; tok = strtok_r(NULL, " ", &save))
 	{
-		sprintf(buf + pos, "%02x", msg[i]);
-		pos += 2;
+		if (strcmp(tok, "sync") == 0)
+			conn->batch_sync = TRUE;
+		else if (strncmp(tok, "tag=", 4) == 0)
+			conn->batch_tag = server_client_tag(conn, atoi(tok + 4) & 0xff);
+		else if (strncmp(tok, "id=", 3) == 0)
+			conn->batch_id = strtoul(tok + 3, NULL, 10);
+		else
+			return FALSE;
 	}
 
-	buf[pos++] = '\n';
+	conn->batching = TRUE;
+	return TRUE;
+}
+
+/* one hex frame per line until "end", a bad one is only reported at the end */
 
-	server_send_data(buf, pos);
+static void server_batch_line(connection *conn, char *cmd)
+{
+	int n;
+
+	if (strcmp(cmd, "end") == 0)
+	{
+		conn->batching = FALSE;
+		if (conn->batch_failed)
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\6", 1);
+			return;
+		}
+		n = ibus_send_frames(conn->batch, conn->batch_len, conn->batch_sync, conn->batch_tag,
+					server_cookie(conn, conn->batch_id));
+		if (n == SEND_QUEUE_FULL)
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\7", 1);
+		}
+		else if (n != 0)
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\6", 1);
+		}
+		return;
+	}
+
+	if (conn->batch_failed)
+	{
+		return;
+	}
+	n = server_parse_hex(cmd, conn->batch + conn->batch_len, BATCH_SIZ - conn->batch_len);
+	if (n == -1)
+	{
+		/* the whole batch is off, but the lines up to "end" still belong to it */
+		conn->batch_failed = TRUE;
+		return;
+	}
+	conn->batch_len += n;
 }
 
-static void server_handle_command(char *cmd, int length)
+static void server_handle_command(connection *conn, char *cmd, int length)
 {
+	char buf[CMD_SIZ];
+	sub_filter f;
+	int i;
+
 	//printf("cmd: |%.*s|\n", length, cmd);
 
+	if (conn->batching)
+	{
+		server_batch_line(conn, cmd);
+		return;
+	}
+
 	if (memcmp(cmd, "tx ", 3) == 0)
 	{
 		//printf("tx: |%s|\n", cmd + 3);
-		if (ibus_send_ascii(cmd + 3) != 0)
+		i = ibus_send_ascii(cmd + 3);
+		if (i == SEND_QUEUE_FULL)
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\7", 1);
+		}
+		else if (i != 0)
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\1", 1);
+		}
+		return;
+	}
+
+	if (strcmp(cmd, "txbatch") == 0 || strncmp(cmd, "txbatch ", 8) == 0)
+	{
+		if (!server_begin_batch(conn, cmd + 7))
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\6", 1);
+		}
+		return;
+	}
+
+	if (memcmp(cmd, "policy ", 7) == 0)
+	{
+		for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
 		{
-			server_send_hex("error ", (unsigned char *)"\1", 1);
+			if (strcmp(cmd + 7, policy_names[i]) == 0)
+			{
+				conn->policy = i;
+				return;
+			}
 		}
+		server_reply_hex(conn, "error ", (unsigned char *)"\2", 1);
 		return;
 	}
 
-	server_send_hex("error ", (unsigned char *)"", 1);
+	if (memcmp(cmd, "sub ", 4) == 0)
+	{
+		if (!server_parse_filter(cmd + 4, &f))
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\3", 1);
+		}
+		else if (server_find_filter(conn, &f) == -1)
+		{
+			if (conn->sub_count == MAX_SUBS)
+			{
+				server_reply_hex(conn, "error ", (unsigned char *)"\4", 1);
+				return;
+			}
+			conn->subs[conn->sub_count++] = f;
+		}
+		return;
+	}
+
+	if (strcmp(cmd, "unsub") == 0)
+	{
+		conn->sub_count = 0;
+		return;
+	}
+
+	if (memcmp(cmd, "unsub ", 6) == 0)
+	{
+		if (!server_parse_filter(cmd + 6, &f))
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\3", 1);
+			return;
+		}
+
+		i = server_find_filter(conn, &f);
+		if (i != -1)
+		{
+			conn->subs[i] = conn->subs[--conn->sub_count];
+		}
+		return;
+	}
+
+	if (strcmp(cmd, "stats") == 0)
+	{
+		i = snprintf(buf, sizeof(buf), "stats queued=%u dropped=%u policy=%s subs=%d\n",
+				conn->out_head - conn->out_tail, conn->dropped, policy_names[conn->policy], conn->sub_count);
+		server_reply(conn, buf, i);
+		return;
+	}
+
+	if (strcmp(cmd, "binary") == 0)
+	{
+		conn->binary = TRUE;
+		return;
+	}
+
+	if (strcmp(cmd, "text") == 0)
+	{
+		conn->binary = FALSE;
+		return;
+	}
+
+	server_reply_hex(conn, "error ", (unsigned char *)"", 1);
+}
+
+static void server_send_txack(connection *conn, uint32_t request, int status)
+{
+	char buf[BIN_HEADER + 5];
+	int i;
+
+	server_bin_header(buf, BIN_TXACK, 0, 5);
+	for (i = 0; i < 4; i++)
+	{
+		buf[BIN_HEADER + i] = request >> (i * 8);
+	}
+	buf[BIN_HEADER + 4] = status;
+
+	server_queue(conn, buf, sizeof(buf));
+}
+
+/* a whole frame from a binary client */
+
+static void server_handle_binary(connection *conn, int type, const unsigned char *payload, int length)
+{
+	char cmd[CMD_SIZ];
+	uint32_t request;
+	int r;
+
+	switch (type)
+	{
+		case BIN_TXREQ:
+			if (length < 4)
+			{
+				break;
+			}
+			request = payload[0] | (payload[1] << 8) | (payload[2] << 16) | ((uint32_t)payload[3] << 24);
+			r = ibus_send_frame(payload + 4, length - 4, server_cookie(conn, request));
+			if (r != 0)
+			{
+				server_send_txack(conn, request, r == SEND_QUEUE_FULL ? TX_QUEUEFULL : TX_BADFRAME);
+			}
+			break;
+
+		case BIN_TXBATCH:
+			if (length < 6)
+			{
+				break;
+			}
+			request = payload[0] | (payload[1] << 8) | (payload[2] << 16) | ((uint32_t)payload[3] << 24);
+			r = ibus_send_frames(payload + 6, length - 6, payload[4] & 1, server_client_tag(conn, payload[5]),
+						server_cookie(conn, request));
+			if (r != 0)
+			{
+				server_send_txack(conn, request, r == SEND_QUEUE_FULL ? TX_QUEUEFULL : TX_BADFRAME);
+			}
+			break;
+
+		case BIN_TEXT:
+			/* a text command, with or without the newline */
+			if (length > 0 && payload[length - 1] == '\n')
+			{
+				length--;
+			}
+			if (length > CMD_SIZ - 1)
+			{
+				server_reply_hex(conn, "error ", (unsigned char *)"\5", 1);
+				break;
+			}
+			memcpy(cmd, payload, length);
+			cmd[length] = 0;
+			server_handle_command(conn, cmd, length);
+			break;
+	}
+}
+
+/* the packet or batch with this cookie echoed back or was thrown away */
+
+void server_notify_done(uint64_t cookie, int status)
+{
+	SList *list;
+	connection *conn;
+	char buf[64];
+	int len;
+
+	for (list = connect_list; list; list = list->next)
+	{
+		conn = list->data;
+		if (conn->id == (cookie >> 32))
+		{
+			if (conn->binary)
+			{
+				server_send_txack(conn, cookie, status);
+			}
+			else
+			{
+				/* only batches have a cookie in text mode */
+				len = snprintf(buf, sizeof(buf), "txdone %u %d\n", (uint32_t)cookie, status);
+				server_queue(conn, buf, len);
+			}
+			return;
+		}
+	}
 }
 
 void server_handle_message(const unsigned char *msg, int length)
 {
-	server_send_hex("rx ", msg, length);
+	shmring_publish(BIN_RX, msg, length);
+	server_send_frame("rx ", BIN_RX, msg, length);
 }
 
 void server_notify_tx(const unsigned char *msg, int length)
 {
-	server_send_hex("tx ", msg, length);
+	shmring_publish(BIN_TX, msg, length);
+	server_send_frame("tx ", BIN_TX, msg, length);
 }
 
-static void server_disconnect(connection *conn)
+/* handle every complete line or frame in conn->in, returns how many bytes were used */
+
+static int server_parse_input(connection *conn)
 {
-	connect_list = slist_remove(connect_list, conn);
-	mainloop_input_remove(conn->tag);
-	close(conn->socket);
-	free(conn);
+	unsigned char *p;
+	unsigned char *nl;
+	int used = 0;
+	int avail;
+	int length;
+
+	/* "binary" can switch modes half way through */
+	while (conn->socket != -1 && used < conn->in_len)
+	{
+		p = (unsigned char *)conn->in + used;
+		avail = conn->in_len - used;
+
+		if (conn->binary)
+		{
+			if (avail < BIN_HEADER)
+			{
+				break;
+			}
+
+			length = p[0] | (p[1] << 8);
+			if (length > BIN_MAX_PAYLOAD)
+			{
+				/* it's not speaking our protocol */
+				server_disconnect(conn);
+				break;
+			}
+
+			if (avail < BIN_HEADER + length)
+			{
+				break;
+			}
+
+			used += BIN_HEADER + length;
+			server_handle_binary(conn, p[2], p + BIN_HEADER, length);
+			continue;
+		}
+
+		nl = memchr(p, '\n', avail);
+		if (nl == NULL)
+		{
+			if (avail >= CMD_SIZ)
+			{
+				/* no room for the rest of it, throw it away up to the newline */
+				conn->overlong = TRUE;
+				used = conn->in_len;
+			}
+			break;
+		}
+
+		length = nl - p;
+		used += length + 1;
+
+		if (length > 0 && p[length - 1] == '\r')
+		{
+			length--;
+		}
+
+		if (conn->overlong || length > CMD_SIZ - 1)
+		{
+			conn->overlong = FALSE;
+			server_reply_hex(conn, "error ", (unsigned char *)"\5", 1);
+			continue;
+		}
+
+		memcpy(conn->cmd, p, length);
+		conn->cmd[length] = 0;
+		server_handle_command(conn, conn->cmd, length);
+	}
+
+	return used;
 }
 
-static void server_read(int condition, connection *conn)
+/* every packet is a whole command line or binary frame */
+
+static void server_read_packet(connection *conn)
 {
+	unsigned char buf[IN_SIZ];
+	int length;
 	int r;
-	unsigned char c;
 
-	while (1)
+	while (conn->socket != -1)
 	{
-		r = read(conn->socket, &c, 1);
+		r = recv(conn->socket, buf, sizeof(buf) - 1, MSG_TRUNC);
 
 		if (r == 0)
 		{
-			//printf("Disconnect ifd=%d e=EOF\n", conn->socket);
 			server_disconnect(conn);
 			return;
 		}
@@ -123,32 +931,100 @@ static void server_read(int condition, connection *conn)
 		{
 			if (errno != EWOULDBLOCK)
 			{
-				//printf("Disconnect ifd=%d e=%d %s\n", conn->socket, errno, strerror(errno));
 				server_disconnect(conn);
 			}
 			return;
 		}
 
-		switch (c)
+		if (r > sizeof(buf) - 1)
 		{
-			case '\n':
-				conn->cmd[conn->pos] = 0;
-				server_handle_command(conn->cmd, conn->pos);
-				conn->pos = 0;
-				break;
-			case '\r':
-				break;
-			default:
-				conn->cmd[conn->pos] = c;
-				if (conn->pos < (CMD_SIZ - 1))
-				{
-					conn->pos++;
-				}
+			/* too big, it got cut short */
+			continue;
+		}
+
+		if (conn->binary)
+		{
+			length = buf[0] | (buf[1] << 8);
+			if (r >= BIN_HEADER && r == BIN_HEADER + length)
+			{
+				server_handle_binary(conn, buf[2], buf + BIN_HEADER, length);
+			}
+			continue;
+		}
+
+		while (r > 0 && (buf[r - 1] == '\n' || buf[r - 1] == '\r'))
+		{
+			r--;
+		}
+		buf[r] = 0;
+		if (r > CMD_SIZ - 1)
+		{
+			server_reply_hex(conn, "error ", (unsigned char *)"\5", 1);
+			continue;
+		}
+		server_handle_command(conn, (char *)buf, r);
+	}
+}
+
+static void server_read_stream(connection *conn)
+{
+	int used;
+	int r;
+	int i;
+
+	for (i = 0; i < READS_PER_WAKEUP && conn->socket != -1; i++)
+	{
+		r = read(conn->socket, conn->in + conn->in_len, IN_SIZ - conn->in_len);
+
+		if (r == 0)
+		{
+			//printf("Disconnect ifd=%d e=EOF\n", conn->socket);
+			server_disconnect(conn);
+			return;
+		}
+
+		if (r == -1)
+		{
+			if (errno != EWOULDBLOCK)
+			{
+				//printf("Disconnect ifd=%d e=%d %s\n", conn->socket, errno, strerror(errno));
+				server_disconnect(conn);
+			}
+			return;
 		}
+
+		conn->in_len += r;
+		used = server_parse_input(conn);
+		memmove(conn->in, conn->in + used, conn->in_len - used);
+		conn->in_len -= used;
 	}
 }
 
-static void server_add_connection(int sock)
+static void server_read(int condition, connection *conn)
+{
+	if (condition == FIA_WRITE)
+	{
+		server_flush(conn);
+		return;
+	}
+
+	if (conn->packet)
+	{
+		server_read_packet(conn);
+	}
+	else
+	{
+		server_read_stream(conn);
+	}
+
+	/* readable wins over writable, a client that keeps talking would never get its replies */
+	if (conn->writing && conn->socket != -1)
+	{
+		server_flush(conn);
+	}
+}
+
+static void server_add_connection(int sock, bool packet)
 {
 	connection *conn;
 
@@ -156,6 +1032,8 @@ static void server_add_connection(int sock)
 
 	conn = calloc(1, sizeof(connection));
 	conn->socket = sock;
+	conn->packet = packet;
+	conn->id = ++last_id;
 	conn->tag = mainloop_input_add(sock, FIA_READ|FIA_EX, (void *)server_read, conn);
 
 	connect_list = slist_prepend(connect_list, conn);
@@ -168,20 +1046,79 @@ static void server_accept(int condition, void *userdata)
 	struct sockaddr_in client_addr;
 
 	sin_size = sizeof (struct sockaddr_in);
-	new_sock = accept(server_socket, (struct sockaddr *) &client_addr, &sin_size);
+	new_sock = accept4(server_socket, (struct sockaddr *) &client_addr, &sin_size, SOCK_CLOEXEC);
 	if (new_sock != -1)
 	{
 		//printf("New connection from (%s : %d)\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-		server_add_connection(new_sock);
+		server_add_connection(new_sock, FALSE);
+	}
+}
+
+static void server_accept_unix(int condition, void *userdata)
+{
+	int new_sock;
+
+	new_sock = accept4(unix_socket, NULL, NULL, SOCK_CLOEXEC);
+	if (new_sock != -1)
+	{
+		server_add_connection(new_sock, TRUE);
 	}
 }
 
+/* call before server_init(). path NULL or "" = no unix socket */
+
+void server_config(const char *path, int listen_backlog)
+{
+	unix_path = (path && path[0]) ? path : NULL;
+	backlog = listen_backlog;
+}
+
+static int server_init_unix(void)
+{
+	struct sockaddr_un addr;
+
+	if ((unix_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+	{
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", unix_path);
+
+	/* left over from last time */
+	unlink(addr.sun_path);
+
+	if (bind(unix_socket, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+	{
+		printf("%s: errno=%d %s\n", unix_path, errno, strerror(errno));
+		close(unix_socket);
+		unix_socket = -1;
+		return 3;
+	}
+
+	listen(unix_socket, backlog);
+	mainloop_input_add(unix_socket, FIA_READ|FIA_EX, server_accept_unix, NULL);
+
+	return 0;
+}
+
 int server_init(int port)
 {
 	struct sockaddr_in server_addr;
 	socklen_t opt;
 
-	if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	if (unix_path)
+	{
+		server_init_unix();
+	}
+
+	if (port == 0)
+	{
+		return 0;
+	}
+
+	if ((server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
 	{
 		return 1;
 	}
@@ -208,7 +1145,7 @@ int server_init(int port)
 	}
 
 	set_nonblocking(server_socket);
-	listen(server_socket, 1);
+	listen(server_socket, backlog);
 	set_blocking(server_socket);
 
 	listen_tag = mainloop_input_add(server_socket, FIA_READ|FIA_EX, server_accept, NULL);
@@ -218,6 +1155,11 @@ int server_init(int port)
 
 void server_cleanup()
 {
+	if (unix_socket != -1)
+	{
+		unlink(unix_path);
+	}
+
 	/*if (listen_tag != -1)
 	{
 		mainloop_input_remove(listen_tag);
@@ -1,4 +1,36 @@
-void server_init(int port);
+/*
+ * Binary protocol, after a client sends "binary\n"
+ *
+ * Both directions use frames of:
+ *
+ *   u16 payload length, u8 type, u8 flags, u64 CLOCK_MONOTONIC microseconds, payload
+ *
+ * All numbers are little endian, the same header as the capture log.
+ */
+
+#define BIN_HEADER 12
+#define BIN_MAX_PAYLOAD 1024
+
+typedef enum
+{
+	BIN_RX = 1,		/* received ibus frame */
+	BIN_TX = 2,		/* ibus frame we're transmitting */
+	BIN_TXREQ = 3,		/* client: u32 request id, ibus frame to send */
+	BIN_TXACK = 4,		/* u32 request id, u8 TX_* status */
+	BIN_TEXT = 5,		/* a text protocol line, both ways ("text" goes back to text mode) */
+	BIN_TXBATCH = 6		/* client: u32 request id, u8 flags (1 = sync), u8 tag (0 = none), frames back to back */
+}
+bin_type;
+
+/* how a transmit request ended */
+#define TX_ECHOED	0	/* it went out and came back on the bus */
+#define TX_BADFRAME	1	/* rejected, the length byte didn't match */
+#define TX_DISCARDED	2	/* thrown away before it echoed back */
+#define TX_QUEUEFULL	3	/* rejected, too much client traffic queued already */
+
+void server_config(const char *path, int listen_backlog);
+int server_init(int port);
 void server_handle_message(const unsigned char *msg, int length);
 void server_notify_tx(const unsigned char *msg, int length);
+void server_notify_done(uint64_t cookie, int status);
 void server_cleanup();
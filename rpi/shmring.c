@@ -0,0 +1,103 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mainloop.h"
+#include "shmring.h"
+
+
+static shmring_header *hdr;
+static shmring_slot *slots;
+static size_t map_size;
+
+
+int shmring_init(void)
+{
+	void *map;
+	int fd;
+
+	fd = shm_open(SHMRING_NAME, O_CREAT | O_RDWR, 0644);
+	if (fd == -1)
+	{
+		return 1;
+	}
+
+	map_size = sizeof(shmring_header) + (SHMRING_SLOTS * sizeof(shmring_slot));
+	if (ftruncate(fd, map_size) != 0)
+	{
+		close(fd);
+		return 2;
+	}
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return 3;
+	}
+
+	hdr = map;
+	slots = (shmring_slot *)(hdr + 1);
+
+	/* carry on from where the last run left off, readers still attached won't notice */
+	if (hdr->magic != SHMRING_MAGIC || hdr->slots != SHMRING_SLOTS || hdr->slot_size != sizeof(shmring_slot))
+	{
+		memset(map, 0, map_size);
+		hdr->slots = SHMRING_SLOTS;
+		hdr->slot_size = sizeof(shmring_slot);
+		__atomic_store_n(&hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+void shmring_publish(int type, const unsigned char *msg, int length)
+{
+	shmring_slot *slot;
+	uint64_t seq;
+
+	if (hdr == NULL)
+	{
+		return;
+	}
+
+	if (length > sizeof(slot->data))
+	{
+		length = sizeof(slot->data);
+	}
+
+	seq = hdr->head;
+	slot = &slots[seq & (SHMRING_SLOTS - 1)];
+
+	/* seqlock: readers that catch it half written see seq change */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->usec = mainloop_get_microsec();
+	slot->length = length;
+	slot->type = type;
+	slot->flags = 0;
+	memcpy(slot->data, msg, length);
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->head, seq + 1, __ATOMIC_RELEASE);
+
+	/* readers map it read-only so they can't say whether they're waiting, just wake them */
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+void shmring_cleanup(void)
+{
+	if (hdr)
+	{
+		munmap(hdr, map_size);
+		hdr = NULL;
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * Shared memory broadcast ring of every received and transmitted frame
+ *
+ * pibus is the only writer. Readers shm_open(SHMRING_NAME, O_RDONLY), mmap
+ * it and keep their own sequence number, nobody waits for anybody:
+ *
+ *   wait while header.head == seq (FUTEX_WAIT on header.futex)
+ *   if header.head - seq > header.slots, the writer lapped us, skip ahead
+ *   slot = slots[seq % header.slots]
+ *   copy it while slot.seq == seq + 1 before and after, otherwise it got
+ *   overwritten underneath us and was lost too
+ *
+ * type is BIN_RX or BIN_TX from server.h, usec is CLOCK_MONOTONIC.
+ */
+
+#define SHMRING_NAME "/pibus-ring"
+#define SHMRING_MAGIC 0x52424950	/* "PIBR" */
+#define SHMRING_SLOTS 1024		/* power of 2 */
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t futex;		/* bumped and woken on every frame */
+	uint64_t head;		/* sequence number of the next frame */
+}
+shmring_header;
+
+typedef struct
+{
+	uint64_t seq;		/* sequence number + 1, 0 while being written */
+	uint64_t usec;
+	uint16_t length;
+	uint8_t type;
+	uint8_t flags;
+	uint8_t data[260];
+}
+shmring_slot;
+
+int shmring_init(void);
+void shmring_publish(int type, const unsigned char *msg, int length);
+void shmring_cleanup(void);